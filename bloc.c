@@ -4,6 +4,15 @@
 #include <string.h>
 #include <math.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "devutils.h"
 #define ARENA_IMPLEMENTATION
@@ -16,6 +25,13 @@
 #define RGFW_IMPORT
 #include "RGFW.h"
 
+// NOTE: implemented in rgfw.c where the native types of the platform are available
+void blit_surface_rectangle(RGFW_window *win, RGFW_surface *surface, int x, int y, int width, int height);
+void blit_surface_free(void);
+RGFW_format native_surface_format(RGFW_window *win);
+void wait_for_event(i32 waitMS);
+void wake_event_loop(void);
+
 #define MIN(x, y) ((x) <= (y) ? (x) : (y))
 #define MAX(x, y) ((x) >= (y) ? (x) : (y))
 #define ABS(x) ((x) >= 0 ? (x) : -(x))
@@ -24,6 +40,32 @@
 #define DEFAULT_BLOCK_COLOR ((Color) { 0,  0,  0, 255})
 #define ZOOM_STEP 0.1
 #define PAN_STEP 0.01
+#define DAMAGE_CAPACITY 16
+#define OPAQUE_BAND_HEIGHT 64
+#define IMAGE_PADDING 4 // bytes after the pixels of an image, reading a narrower pixel as 4 bytes stays inside
+#define MIPMAP_CAPACITY 16
+#define TILE_SIZE 64 // has to be a power of two
+#define MIN_BAND_HEIGHT 16
+#define FRAME_BUDGET 16.0  // milliseconds a frame may take while the view changes, unless the frame rate is capped
+#define REFINE_DELAY 150.0 // milliseconds without view changes before the filtered version is drawn
+#define BLOCK_CELL_SIZE 128 // side length in texels of the cells of Block_Grid
+#define FRAMEBUFFER_STEP 256 // the framebuffer grows in multiples of this many pixels per side
+#define EXPORT_QUEUE_CAPACITY 4 // exported images that may wait for the background thread
+#define PNG_CHUNK_SIZE (256*1024) // filtered bytes of a PNG that are compressed together
+#define EXPORT_BUFFER_SIZE (64*1024) // encoded bytes that are collected before they are written
+#define QOI_CHUNK_SIZE (256*1024) // pixels of a QOI that are encoded together
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define JPEG_LOOKUP_BITS 9 // huffman codes up to this length are decoded with a table
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xC0
+#define QOI_OP_RGB   0xFE
+#define QOI_OP_RGBA  0xFF
+#define QOI_PIXELS_MAX 400000000 // like the reference decoder
+#define FIXED_SHIFT 32
+#define FIXED_ONE ((Fixed) 1 << FIXED_SHIFT)
 
 typedef struct {
     const char **items;
@@ -47,6 +89,45 @@ typedef struct {
     size_t capacity;
 } Vector_Stack;
 
+// the texels [x0, x1) x [y0, y1) of the image
+typedef struct {
+    int x0, y0, x1, y1;
+} Texel_Rectangle;
+
+typedef struct {
+    size_t *items;
+    size_t count;
+    size_t capacity;
+} Index_DA;
+
+// the pixels [x0, x1) of a row
+typedef struct {
+    int x0, x1;
+} Span;
+
+typedef struct {
+    int y0, y1; // the rows [y0, y1) all have the same spans
+    Span *spans;
+    size_t count;
+} Coverage_Band;
+
+// NOTE: the union of a list of rectangles as bands of rows, each with disjoint spans sorted by x,
+// so that every covered pixel is written exactly once however much the rectangles overlap
+typedef struct {
+    Coverage_Band *items;
+    size_t count;
+} Coverage;
+
+// NOTE: the committed blocks are bucketed into a uniform grid over the image, so that a frame
+// only visits the blocks that overlap the part of the image that is drawn
+typedef struct {
+    int columns, rows;
+    Index_DA *cells;         // row by row, the blocks overlapping each cell in ascending order
+    Texel_Rectangle *texels; // texels of the i-th block
+    size_t count;
+    size_t capacity;
+} Block_Grid;
+
 typedef struct Color {
     unsigned char r;
     unsigned char g;
@@ -54,22 +135,201 @@ typedef struct Color {
     unsigned char a;
 } Color;
 
+typedef enum {
+    LAYOUT_LINEAR, // row by row
+    LAYOUT_TILED,  // TILE_SIZE x TILE_SIZE tiles ordered along a Z-order curve, row by row inside a tile
+} Layout;
+
+// pixels of the image or of a downscaled version of it
+typedef struct {
+    unsigned char *pixel_data;
+    int width, height;
+    int channels;
+    bool *opaque_bands;
+} Mipmap;
+
 typedef struct {
     unsigned char *pixel_data;
     int width, height;
+    // NOTE: images keep the channels of their file: gray (1), gray and alpha (2), RGB (3) or
+    // RGBA (4), with the color channels in the order of pixel_format
+    int channels;
+    // opaque_bands[k] tells whether rows [k*OPAQUE_BAND_HEIGHT, (k+1)*OPAQUE_BAND_HEIGHT) have no transparent pixels
+    bool *opaque_bands;
+    // mipmaps[k] is box filtered to half the size of mipmaps[k-1] (or of the image for k = 0),
+    // they are built on first use
+    Mipmap mipmaps[MIPMAP_CAPACITY];
     Vector2 center;
     float scale;
     Vector_Stack stack;
+    Block_Grid grid; // the blocks of stack up to its count
+    // NOTE: the cursor alone does not tell whether the blocks changed, an undo followed by a click
+    // replaces a block at the same cursor. generation changes with every edit of the blocks and
+    // replaced covers the overwritten blocks and the ones that took their place since the last frame.
+    size_t generation;
+    Texel_Rectangle replaced;
+    const char *path;
 } Draw_Context;
 
+// screen regions that have to be repainted and blitted in the next frame
+typedef struct {
+    Rectangle items[DAMAGE_CAPACITY];
+    bool base[DAMAGE_CAPACITY]; // the base layer of the item is outdated as well
+    size_t count;
+    bool full;  // repaint the whole window
+    bool moved; // the content was scrolled so the whole window needs to be blitted
+} Damage;
+
+// fixed point number with FIXED_SHIFT fractional bits
+typedef int64_t Fixed;
+
+// maps the screen pixel p to the texel (step*p + offset) >> (FIXED_SHIFT + level) of a mipmap level
+typedef struct {
+    Fixed step;
+    Fixed offset;
+} Axis_Mapping;
+
+typedef struct {
+    Axis_Mapping x, y;
+} View_Mapping;
+
+typedef enum {
+    QUALITY_FAST,     // nearest neighbour at half the resolution
+    QUALITY_NEAREST,
+    QUALITY_FILTERED, // bilinear between the texels of the mipmap level
+    QUALITY_COUNT,
+} Quality;
+
+typedef enum {
+    SUBSAMPLING_AUTO, // 4:2:0 up to quality 90 and 4:4:4 above, like stbi_write_jpg
+    SUBSAMPLING_444,
+    SUBSAMPLING_422,
+    SUBSAMPLING_420,
+} Subsampling;
+
+// how the image is sampled inside of a clip rectangle
+typedef struct {
+    Quality quality;
+    Mipmap image;
+    View_Mapping map;
+    int level;
+    int x0, x1, y0, y1;    // part of the clip rectangle that is covered by the image
+    int *columns;          // offset of the source column of every screen column in [x0, x1)
+    int *next_columns;     // QUALITY_FILTERED: offset of the column right of it
+    uint16_t *weights;     // QUALITY_FILTERED: weight of the next column out of 128
+    bool contiguous;
+} Image_Sampler;
+
+// everything that is needed to draw a clip rectangle, it is prepared once on the main thread
+// so that horizontal bands of the rectangle can be drawn in parallel
+typedef struct {
+    Rectangle clip;
+    bool base; // redraw the base layer as well
+    Image_Sampler sampler;
+    View_Mapping map;
+    Coverage blocks; // the pixels of clip that are covered by committed blocks
+    bool has_preview;
+    Rectangle preview;
+} Draw_Job;
+
+typedef struct {
+    uint8_t *items;
+    size_t count;
+    size_t capacity;
+} Byte_DA;
+
+// writes bits starting at the least significant bit of each byte, as deflate wants them
+typedef struct {
+    Byte_DA bytes;
+    uint32_t bits;
+    int bit_count;
+} Bit_Writer;
+
+// everything needed to export an image, independent of the Draw_Context it came from
+typedef struct {
+    const char *path;
+    const char *ext;
+    const char *source;  // the file the image was loaded from
+    uint8_t *pixel_data; // owned by the job, in pixel_layout and pixel_format
+    int width, height;
+    int channels;
+    Texel_Rectangle *blocks;
+    size_t block_count;
+} Export_Job;
+
+// NOTE: images are exported by a background thread, so that the next image can be edited
+// while the previous one is still encoded. At most EXPORT_QUEUE_CAPACITY jobs wait at a time,
+// pushing another one blocks until the oldest was taken.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    Export_Job items[EXPORT_QUEUE_CAPACITY]; // ring buffer
+    size_t first;
+    size_t count;
+    bool busy; // a job was taken and is exported right now
+    bool quit;
+    size_t failed;
+} Export_Queue;
+
+typedef void (*Task)(void *arg, size_t index);
+
+// persistent worker threads, the thread that calls pool_run works as well
+typedef struct {
+    pthread_t *threads;
+    size_t thread_count; // including the calling thread, 1 runs everything serially
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    Task task;
+    void *arg;
+    size_t task_count;
+    size_t next_task;
+    size_t finished_tasks;
+    bool quit;
+} Worker_Pool;
+
+// view changes that arrived since the last frame, they are applied at once right before drawing
+typedef struct {
+    float zoom;       // factor for the scale
+    int pan_x, pan_y; // pan steps
+} View_Input;
+
+// everything that determines what is currently visible on the screen
+typedef struct {
+    Vector2 center;
+    float scale;
+    Rectangle screen;
+    size_t cursor;
+    size_t generation;
+    Quality quality;
+    bool has_preview;
+    Rectangle preview;
+} Frame_State;
+
 Arena global_arena = {0};
+Arena frame_arena  = {0}; // temporary memory that lives until the next frame is drawn
 static String_DA input_paths  = {0};
 static String_DA output_paths = {0};
 RGFW_window *win = NULL;
 RGFW_surface *surface = NULL;
 unsigned char *pixel_buffer;
+unsigned char *base_buffer; // the image and the committed blocks without the preview, same layout as pixel_buffer
 size_t pixel_stride;
+int framebuffer_width  = 0; // size pixel_buffer, base_buffer and surface were allocated with
+int framebuffer_height = 0;
 Color block_color = DEFAULT_BLOCK_COLOR;
+Layout pixel_layout = LAYOUT_LINEAR; // how image pixels are stored in memory
+RGFW_format pixel_format = RGFW_formatRGBA8; // channel order of pixel_buffer and of the loaded images
+size_t thread_count = 0;             // 0 means one per processor
+size_t frame_rate = 0;               // maximal frames per second, 0 means no limit
+Quality quality = QUALITY_FILTERED;  // how the image is sampled in the next frame
+Worker_Pool pool = {0};
+size_t export_thread_count = 0;      // 0 means one per processor
+Worker_Pool export_pool = {0};       // only used by the thread of export_queue
+Export_Queue export_queue = {0};
+int jpeg_quality = 0;                // 1 to 100, 0 keeps JPEG sources as they are and encodes others with 50
+Subsampling jpeg_subsampling = SUBSAMPLING_AUTO;
 
 Vector2 vector2_zero() {
     Vector2 result = {
@@ -138,6 +398,175 @@ bool in_rectangle(Vector2 v, Rectangle r) {
     return true;
 }
 
+bool rectangle_empty(Rectangle r) {
+    return r.width <= 0 || r.height <= 0;
+}
+
+bool rectangle_equal(Rectangle a, Rectangle b) {
+    return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
+
+bool rectangle_overlaps(Rectangle a, Rectangle b) {
+    if (a.x+a.width  <= b.x) return false;
+    if (b.x+b.width  <= a.x) return false;
+    if (a.y+a.height <= b.y) return false;
+    if (b.y+b.height <= a.y) return false;
+    return true;
+}
+
+Rectangle rectangle_intersect(Rectangle a, Rectangle b) {
+    float x0 = fmaxf(a.x, b.x);
+    float y0 = fmaxf(a.y, b.y);
+    float x1 = fminf(a.x+a.width,  b.x+b.width);
+    float y1 = fminf(a.y+a.height, b.y+b.height);
+    Rectangle result = {
+        .x = x0, .y = y0,
+        .width  = fmaxf(x1 - x0, 0),
+        .height = fmaxf(y1 - y0, 0),
+    };
+    return result;
+}
+
+Rectangle rectangle_union(Rectangle a, Rectangle b) {
+    float x0 = fminf(a.x, b.x);
+    float y0 = fminf(a.y, b.y);
+    float x1 = fmaxf(a.x+a.width,  b.x+b.width);
+    float y1 = fmaxf(a.y+a.height, b.y+b.height);
+    Rectangle result = {
+        .x = x0, .y = y0,
+        .width  = x1 - x0,
+        .height = y1 - y0,
+    };
+    return result;
+}
+
+// smallest rectangle with integer coordinates that contains every pixel touched by r
+Rectangle rectangle_snap(Rectangle r) {
+    float x0 = floorf(r.x);
+    float y0 = floorf(r.y);
+    Rectangle result = {
+        .x = x0, .y = y0,
+        .width  = ceilf(r.x+r.width)  - x0,
+        .height = ceilf(r.y+r.height) - y0,
+    };
+    return result;
+}
+
+// View mapping
+//
+// NOTE: the screen and export() agree on every pixel because both of them go through the same
+// integer mappings: a screen pixel shows the texel its View_Mapping gives and a block covers
+// exactly the texels whose centers lie inside of it.
+
+Fixed fixed_from_double(double x) {
+    return llround(x * FIXED_ONE);
+}
+
+double fixed_to_double(Fixed x) {
+    return (double) x / FIXED_ONE;
+}
+
+int axis_texel(Axis_Mapping m, int pixel, int level) {
+    return (m.step * pixel + m.offset) >> (FIXED_SHIFT + level);
+}
+
+// the first pixel that is mapped to texel or beyond, step has to be positive
+int axis_pixel(Axis_Mapping m, int texel, int level) {
+    Fixed a = ((Fixed) texel << (FIXED_SHIFT + level)) - m.offset + m.step - 1;
+    Fixed q = a / m.step;
+    if (a % m.step != 0 && a < 0) q--;
+    return q;
+}
+
+// Pixel layout
+//
+// NOTE: in both layouts the offset (in pixels) of pixel (x, y) splits into
+// column_offset(width, height, x) + row_offset(width, height, y), because interleaving the bits of
+// the tile coordinates puts the bits of x and y into disjoint positions. This keeps the sampling
+// separable. The Z-order curve would need about as many tiles as a square around the longer side,
+// so the tiles are grouped into squares of layout_block tiles that fit the shorter side. These
+// squares follow each other along the longer side, one of the two block indices is always 0.
+
+// moves bit i of x to bit 2*i of the result
+uint64_t morton_spread(uint64_t x) {
+    x &= 0xFFFFFFFF;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFF;
+    x = (x | (x <<  8)) & 0x00FF00FF00FF00FF;
+    x = (x | (x <<  4)) & 0x0F0F0F0F0F0F0F0F;
+    x = (x | (x <<  2)) & 0x3333333333333333;
+    x = (x | (x <<  1)) & 0x5555555555555555;
+    return x;
+}
+
+// the side in tiles of the squares that are ordered along a Z-order curve, the smallest power of two
+// that covers the shorter side of the image
+size_t layout_block(int width, int height) {
+    int tiles = (MIN(width, height) + TILE_SIZE - 1) / TILE_SIZE;
+    size_t result = 1;
+    while ((int) result < tiles) result *= 2;
+    return result;
+}
+
+size_t column_offset(int width, int height, int x) {
+    if (pixel_layout == LAYOUT_LINEAR) return x;
+    size_t block = layout_block(width, height);
+    size_t tile = x / TILE_SIZE;
+    return (tile / block * block * block + morton_spread(tile % block)) * TILE_SIZE * TILE_SIZE + x % TILE_SIZE;
+}
+
+size_t row_offset(int width, int height, int y) {
+    if (pixel_layout == LAYOUT_LINEAR) return (size_t) y * width;
+    size_t block = layout_block(width, height);
+    size_t tile = y / TILE_SIZE;
+    return (tile / block * block * block + (morton_spread(tile % block) << 1)) * TILE_SIZE * TILE_SIZE + (y % TILE_SIZE) * TILE_SIZE;
+}
+
+uint8_t *pixel_at(uint8_t *pixel_data, int width, int height, int channels, int x, int y) {
+    return &pixel_data[(column_offset(width, height, x) + row_offset(width, height, y)) * channels];
+}
+
+// number of pixels starting at column x (at most count) that follow each other in memory
+size_t pixel_run(int x, size_t count) {
+    if (pixel_layout == LAYOUT_LINEAR) return count;
+    return MIN(count, (size_t) (TILE_SIZE - x % TILE_SIZE));
+}
+
+// number of pixels that have to be allocated for an image of the given size
+size_t layout_size(int width, int height) {
+    if (pixel_layout == LAYOUT_LINEAR) return (size_t) width * height;
+    if (width == 0 || height == 0) return 0;
+    // the last tile in Z-order is the one in the bottom right corner, at most 4 times the tiles of
+    // the image because the squares are at most twice as large as the shorter side and the last
+    // square is not filled
+    size_t tile = column_offset(width, height, width - 1) + row_offset(width, height, height - 1);
+    return (tile / (TILE_SIZE * TILE_SIZE) + 1) * TILE_SIZE * TILE_SIZE;
+}
+
+// converts row by row pixels into the current layout, the result has to be freed
+uint8_t *layout_from_linear(const uint8_t *linear, int width, int height, int channels) {
+    uint8_t *result = malloc(layout_size(width, height) * channels + IMAGE_PADDING);
+    assert(result != NULL);
+    for (int i=0; i<height; i++) {
+        for (int j=0; j<width;) {
+            size_t n = pixel_run(j, width - j);
+            memcpy(pixel_at(result, width, height, channels, j, i), &linear[((size_t) i*width + j)*channels], n*channels);
+            j += n;
+        }
+    }
+    return result;
+}
+
+// copies the rows [y, y+count) of the image to linear, row by row
+void layout_to_linear(uint8_t *pixel_data, int width, int height, int channels, int y, int count, uint8_t *linear) {
+    for (int i=0; i<count; i++) {
+        for (int j=0; j<width;) {
+            size_t n = pixel_run(j, width - j);
+            memcpy(&linear[((size_t) i*width + j)*channels], pixel_at(pixel_data, width, height, channels, j, y + i), n*channels);
+            j += n;
+        }
+    }
+}
+
 void push_point(Vector_Stack *stack, Vector2 v) {
     if (stack->capacity == 0) {
         stack->capacity = 16;
@@ -177,6 +606,14 @@ Color parse_color(const char *str) {
     return result;
 }
 
+Subsampling parse_subsampling(const char *str) {
+    if (strcmp(str, "444") == 0) return SUBSAMPLING_444;
+    if (strcmp(str, "422") == 0) return SUBSAMPLING_422;
+    if (strcmp(str, "420") == 0) return SUBSAMPLING_420;
+    printf("[ERROR] unknown chroma subsampling '%s', expected 444, 422 or 420\n", str);
+    exit(1);
+}
+
 const char *get_file_name(const char *path) {
     char *last_slash = strrchr(path, '/');
     if (last_slash == NULL) {
@@ -228,6 +665,55 @@ void parse_commands(int argc, const char **argv) {
             }
             block_color = parse_color(argv[i+1]);
             i++;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            // NOTE: the image is padded to whole tiles and the tiles to squares that cover the
+            // shorter side (see layout_block), this takes at most 4 times the tiles of the image
+            // however wide or tall it is
+            pixel_layout = LAYOUT_TILED;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (i == argc-1) {
+                printf("[ERROR] no matching argument found to '-j' flag\n");
+                print_usage(argv[0]);
+                exit(1);
+            }
+            thread_count = strtoul(argv[i+1], NULL, 10);
+            i++;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            if (i == argc-1) {
+                printf("[ERROR] no matching argument found to '-e' flag\n");
+                print_usage(argv[0]);
+                exit(1);
+            }
+            export_thread_count = strtoul(argv[i+1], NULL, 10);
+            i++;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            if (i == argc-1) {
+                printf("[ERROR] no matching argument found to '-f' flag\n");
+                print_usage(argv[0]);
+                exit(1);
+            }
+            frame_rate = strtoul(argv[i+1], NULL, 10);
+            i++;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            if (i == argc-1) {
+                printf("[ERROR] no matching argument found to '-q' flag\n");
+                print_usage(argv[0]);
+                exit(1);
+            }
+            jpeg_quality = strtol(argv[i+1], NULL, 10);
+            if (jpeg_quality < 1 || jpeg_quality > 100) {
+                printf("[ERROR] JPEG quality has to be between 1 and 100\n");
+                exit(1);
+            }
+            i++;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            if (i == argc-1) {
+                printf("[ERROR] no matching argument found to '-s' flag\n");
+                print_usage(argv[0]);
+                exit(1);
+            }
+            jpeg_subsampling = parse_subsampling(argv[i+1]);
+            i++;
         } else {
             arena_da_append(&global_arena, &input_paths, argv[i]);
         }
@@ -249,32 +735,330 @@ void parse_commands(int argc, const char **argv) {
     }
 }
 
-void draw_context_load(Draw_Context *ctx, const char *path) {
+bool *find_opaque_bands(uint8_t *pixel_data, int width, int height, int channels, bool opaque) {
+    size_t band_count = (height + OPAQUE_BAND_HEIGHT - 1) / OPAQUE_BAND_HEIGHT;
+    bool *result = malloc(sizeof(*result) * band_count);
+    assert(result != NULL);
+    for (size_t k=0; k<band_count; k++) {
+        result[k] = opaque;
+        if (!opaque) {
+            uint8_t all = 0xFF;
+            for (int i=k*OPAQUE_BAND_HEIGHT; i<MIN(height, (int) (k+1)*OPAQUE_BAND_HEIGHT); i++) {
+                for (int j=0; j<width;) {
+                    size_t n = pixel_run(j, width - j);
+                    uint8_t *run = pixel_at(pixel_data, width, height, channels, j, i);
+                    for (size_t l=0; l<n; l++) all &= run[l*channels + channels-1];
+                    j += n;
+                }
+            }
+            result[k] = all == 0xFF;
+        }
+    }
+    return result;
+}
+
+// converts between RGB(A) and BGR(A), gray pixels stay as they are
+void swap_red_blue(uint8_t *pixels, size_t count, int channels) {
+    if (channels < 3) return;
+    for (size_t i=0; i<count; i++) {
+        uint8_t r = pixels[i*channels + 0];
+        pixels[i*channels + 0] = pixels[i*channels + 2];
+        pixels[i*channels + 2] = r;
+    }
+}
+
+// c with its channels in the order of pixel_format
+Color native_color(Color c) {
+    if (pixel_format == RGFW_formatBGRA8) {
+        uint8_t r = c.r;
+        c.r = c.b;
+        c.b = r;
+    }
+    return c;
+}
+
+// QOI
+//
+// NOTE: QOI (https://qoiformat.org) is a lossless format that is much cheaper to encode and decode
+// than PNG. Every pixel is stored as a run of the previous pixel, as a reference into an index of
+// the last 64 pixels by their hash, as a small difference to the previous pixel or as it is.
+// Pixels are handled as uint32_t with the channels RGBA from the lowest byte on.
+
+uint8_t qoi_hash(uint32_t px) {
+    return ((px & 0xFF) * 3 + (px >> 8 & 0xFF) * 5 + (px >> 16 & 0xFF) * 7 + (px >> 24) * 11) % 64;
+}
+
+// adds the bytes of delta to the bytes of px without carrying between them
+uint32_t qoi_add(uint32_t px, uint32_t delta) {
+    return ((px & 0x7F7F7F7F) + (delta & 0x7F7F7F7F)) ^ ((px ^ delta) & 0x80808080);
+}
+
+uint32_t get_u32_be(const uint8_t *in) {
+    return (uint32_t) in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+}
+
+// decodes a QOI file with the channels of the file like stbi_load, followed by IMAGE_PADDING bytes,
+// returns NULL if it can not be read
+uint8_t *qoi_load(const char *path, int *width, int *height, int *channels_in_file) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+    uint8_t *data = NULL;
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        data = malloc(MAX(size, 1));
+        assert(data != NULL);
+        if (fread(data, 1, size, f) != (size_t) size) size = -1;
+    }
+    fclose(f);
+
+    const size_t header_size = 14, padding = 8;
+    uint8_t *result = NULL;
+    uint32_t w = 0, h = 0;
+    if (size >= (long) (header_size + padding) && memcmp(data, "qoif", 4) == 0) {
+        w = get_u32_be(&data[4]);
+        h = get_u32_be(&data[8]);
+        *channels_in_file = data[12];
+    }
+    if (w > 0 && h > 0 && h < QOI_PIXELS_MAX / w && (*channels_in_file == 3 || *channels_in_file == 4)) {
+        size_t count = (size_t) w * h;
+        int n = *channels_in_file;
+        // every pixel is written as 4 bytes, the one after it overwrites what does not belong to it
+        result = malloc(count * n + IMAGE_PADDING);
+        assert(result != NULL);
+        uint32_t index[64] = {0};
+        uint32_t px = 0xFF000000;
+        size_t p = header_size, end = size - padding; // an op reads at most 4 bytes after its first
+        size_t i = 0;
+        while (i < count && p < end) {
+            uint8_t b1 = data[p++];
+            if (b1 == QOI_OP_RGB) {
+                px = (px & 0xFF000000) | data[p] | data[p+1] << 8 | data[p+2] << 16;
+                p += 3;
+            } else if (b1 == QOI_OP_RGBA) {
+                px = data[p] | data[p+1] << 8 | data[p+2] << 16 | (uint32_t) data[p+3] << 24;
+                p += 4;
+            } else if ((b1 & 0xC0) == QOI_OP_INDEX) {
+                px = index[b1];
+            } else if ((b1 & 0xC0) == QOI_OP_DIFF) {
+                uint32_t delta = (uint8_t) ((b1 >> 4 & 3) - 2) | (uint8_t) ((b1 >> 2 & 3) - 2) << 8 | (uint8_t) ((b1 & 3) - 2) << 16;
+                px = qoi_add(px, delta);
+            } else if ((b1 & 0xC0) == QOI_OP_LUMA) {
+                uint8_t b2 = data[p++];
+                int dg = (b1 & 0x3F) - 32;
+                uint32_t delta = (uint8_t) (dg - 8 + (b2 >> 4)) | (uint8_t) dg << 8 | (uint8_t) (dg - 8 + (b2 & 0xF)) << 16;
+                px = qoi_add(px, delta);
+            } else {
+                size_t run = MIN((size_t) (b1 & 0x3F), count - i - 1);
+                for (size_t k=0; k<run; k++) memcpy(&result[(i + k)*n], &px, 4);
+                i += run;
+            }
+            index[qoi_hash(px)] = px;
+            memcpy(&result[i*n], &px, 4);
+            i++;
+        }
+        if (i < count) {
+            free(result);
+            result = NULL;
+        }
+    }
+    free(data);
+    *width = w;
+    *height = h;
+    return result;
+}
+
+// returns false if the image can not be read
+bool draw_context_load(Draw_Context *ctx, const char *path) {
     int width, height, channels_in_file;
-    ctx->pixel_data = stbi_load(path, &width, &height, &channels_in_file, 4);
+    if (strcmp(get_file_ext(path), ".qoi") == 0) {
+        ctx->pixel_data = qoi_load(path, &width, &height, &channels_in_file);
+    } else {
+        ctx->pixel_data = stbi_load(path, &width, &height, &channels_in_file, 0);
+        if (ctx->pixel_data != NULL) {
+            ctx->pixel_data = realloc(ctx->pixel_data, (size_t) width * height * channels_in_file + IMAGE_PADDING);
+            assert(ctx->pixel_data != NULL);
+        }
+    }
+    if (ctx->pixel_data == NULL) {
+        printf("[ERROR] could not load image '%s'\n", path);
+        return false;
+    }
+    ctx->path = path;
     ctx->width = width;
     ctx->height = height;
+    ctx->channels = channels_in_file;
+
+    if (pixel_format == RGFW_formatBGRA8) swap_red_blue(ctx->pixel_data, (size_t) width * height, ctx->channels);
+    if (pixel_layout != LAYOUT_LINEAR) {
+        uint8_t *linear = ctx->pixel_data;
+        ctx->pixel_data = layout_from_linear(linear, width, height, ctx->channels);
+        stbi_image_free(linear);
+    }
+
+    bool opaque = ctx->channels == 1 || ctx->channels == 3;
+    ctx->opaque_bands = find_opaque_bands(ctx->pixel_data, width, height, ctx->channels, opaque);
 
     ctx->center = (Vector2) {
         .x = width / 2.0f,
         .y = height / 2.0f,
     };
     ctx->scale = 1;
+    return true;
+}
+
+// level 0 is the image itself, level k > 0 is mipmaps[k-1] which gets built here if needed
+Mipmap draw_context_level(Draw_Context *ctx, size_t level) {
+    Mipmap result = {
+        .pixel_data = ctx->pixel_data,
+        .width = ctx->width,
+        .height = ctx->height,
+        .channels = ctx->channels,
+        .opaque_bands = ctx->opaque_bands,
+    };
+    for (size_t k=0; k<level; k++) {
+        Mipmap *mip = &ctx->mipmaps[k];
+        if (mip->pixel_data == NULL) {
+            mip->width  = (result.width  + 1) / 2;
+            mip->height = (result.height + 1) / 2;
+            mip->channels = result.channels;
+            mip->pixel_data = malloc(layout_size(mip->width, mip->height) * mip->channels + IMAGE_PADDING);
+            assert(mip->pixel_data != NULL);
+            bool opaque = true;
+            for (int i=0; i<mip->height; i++) {
+                // at odd sizes the last row and column only average the pixels that exist
+                int y0 = 2*i, y1 = MIN(2*i + 1, result.height - 1);
+                for (int j=0; j<mip->width; j++) {
+                    int x0 = 2*j, x1 = MIN(2*j + 1, result.width - 1);
+                    int n = result.channels;
+                    uint8_t *a = pixel_at(result.pixel_data, result.width, result.height, n, x0, y0);
+                    uint8_t *b = pixel_at(result.pixel_data, result.width, result.height, n, x1, y0);
+                    uint8_t *c = pixel_at(result.pixel_data, result.width, result.height, n, x0, y1);
+                    uint8_t *d = pixel_at(result.pixel_data, result.width, result.height, n, x1, y1);
+                    uint8_t *out = pixel_at(mip->pixel_data, mip->width, mip->height, n, j, i);
+                    for (int l=0; l<n; l++) {
+                        out[l] = ((unsigned int) a[l] + b[l] + c[l] + d[l] + 2) / 4;
+                    }
+                }
+                opaque = opaque && result.opaque_bands[y0 / OPAQUE_BAND_HEIGHT] && result.opaque_bands[y1 / OPAQUE_BAND_HEIGHT];
+            }
+            mip->opaque_bands = find_opaque_bands(mip->pixel_data, mip->width, mip->height, mip->channels, opaque);
+        }
+        result = *mip;
+    }
+    return result;
+}
+
+void block_grid_free(Block_Grid *grid) {
+    for (int i=0; i<grid->columns*grid->rows; i++) free(grid->cells[i].items);
+    free(grid->cells);
+    free(grid->texels);
+    memset(grid, 0, sizeof(*grid));
 }
 
-Draw_Context draw_context_new(const char *path) {
-    Draw_Context result = {
-        .stack = {0},
+// the cells of the grid that t overlaps, t has to lie inside of the image
+Texel_Rectangle block_grid_cells(Texel_Rectangle t) {
+    Texel_Rectangle result = {
+        .x0 = t.x0 / BLOCK_CELL_SIZE,
+        .y0 = t.y0 / BLOCK_CELL_SIZE,
+        .x1 = (t.x1 - 1) / BLOCK_CELL_SIZE + 1,
+        .y1 = (t.y1 - 1) / BLOCK_CELL_SIZE + 1,
     };
-    draw_context_load(&result, path);
     return result;
 }
 
+// append a block to the grid of an image of the given size
+void block_grid_insert(Block_Grid *grid, int width, int height, Texel_Rectangle t) {
+    if (grid->cells == NULL) {
+        grid->columns = (width  + BLOCK_CELL_SIZE - 1) / BLOCK_CELL_SIZE;
+        grid->rows    = (height + BLOCK_CELL_SIZE - 1) / BLOCK_CELL_SIZE;
+        grid->cells = calloc(grid->columns * grid->rows, sizeof(*grid->cells));
+        assert(grid->cells != NULL);
+    }
+    if (grid->count == grid->capacity) {
+        grid->capacity = grid->capacity == 0 ? 16 : 2*grid->capacity;
+        grid->texels = realloc(grid->texels, sizeof(*grid->texels) * grid->capacity);
+        assert(grid->texels != NULL);
+    }
+    size_t index = grid->count++;
+    grid->texels[index] = t;
+    if (t.x0 >= t.x1 || t.y0 >= t.y1) return;
+
+    Texel_Rectangle cells = block_grid_cells(t);
+    for (int cy=cells.y0; cy<cells.y1; cy++) {
+        for (int cx=cells.x0; cx<cells.x1; cx++) {
+            Index_DA *cell = &grid->cells[cy*grid->columns + cx];
+            if (cell->count == cell->capacity) {
+                cell->capacity = cell->capacity == 0 ? 4 : 2*cell->capacity;
+                cell->items = realloc(cell->items, sizeof(*cell->items) * cell->capacity);
+                assert(cell->items != NULL);
+            }
+            cell->items[cell->count++] = index;
+        }
+    }
+}
+
+// remove the blocks from count on
+void block_grid_truncate(Block_Grid *grid, size_t count) {
+    if (grid->count <= count) return;
+    for (int i=0; i<grid->columns*grid->rows; i++) {
+        Index_DA *cell = &grid->cells[i];
+        while (cell->count > 0 && cell->items[cell->count-1] >= count) cell->count--;
+    }
+    grid->count = count;
+}
+
+// writes the blocks below limit that overlap area to result and returns how many there are,
+// result needs space for limit indices
+size_t block_grid_query(Block_Grid *grid, Texel_Rectangle area, size_t limit, size_t *result) {
+    size_t count = 0;
+    area.x0 = MAX(area.x0, 0);
+    area.y0 = MAX(area.y0, 0);
+    area.x1 = MIN(area.x1, grid->columns*BLOCK_CELL_SIZE);
+    area.y1 = MIN(area.y1, grid->rows*BLOCK_CELL_SIZE);
+    if (area.x0 >= area.x1 || area.y0 >= area.y1) return 0;
+
+    Texel_Rectangle cells = block_grid_cells(area);
+    for (int cy=cells.y0; cy<cells.y1; cy++) {
+        for (int cx=cells.x0; cx<cells.x1; cx++) {
+            Index_DA *cell = &grid->cells[cy*grid->columns + cx];
+            for (size_t k=0; k<cell->count && cell->items[k] < limit; k++) {
+                Texel_Rectangle t = grid->texels[cell->items[k]];
+                if (t.x1 <= area.x0 || area.x1 <= t.x0 || t.y1 <= area.y0 || area.y1 <= t.y0) continue;
+                // a block that spans several cells is only reported by the first one inside of area
+                if (MAX(t.x0, area.x0) / BLOCK_CELL_SIZE != cx || MAX(t.y0, area.y0) / BLOCK_CELL_SIZE != cy) continue;
+                result[count++] = cell->items[k];
+            }
+        }
+    }
+    return count;
+}
+
+// loads the first image from paths[*index] on that can be read, returns the number of skipped ones
+// NOTE: it does not exit on an image that can not be read, because the images before it may still
+// be exported in the background
+size_t draw_context_load_next(Draw_Context *ctx, String_DA *paths, size_t *index) {
+    size_t skipped = 0;
+    while (*index < paths->count && !draw_context_load(ctx, paths->items[*index])) {
+        (*index)++;
+        skipped++;
+    }
+    return skipped;
+}
+
 void draw_context_reset(Draw_Context *ctx) {
     stbi_image_free(ctx->pixel_data);
     ctx->pixel_data = NULL;
+    free(ctx->opaque_bands);
+    ctx->opaque_bands = NULL;
+    for (size_t k=0; k<MIPMAP_CAPACITY; k++) {
+        free(ctx->mipmaps[k].pixel_data);
+        free(ctx->mipmaps[k].opaque_bands);
+    }
+    memset(ctx->mipmaps, 0, sizeof(ctx->mipmaps));
     ctx->stack.count = 0;
     ctx->stack.cursor = 0;
+    ctx->replaced = (Texel_Rectangle) {0};
+    block_grid_free(&ctx->grid);
 }
 
 Vector2 get_mouse_position() {
@@ -287,12 +1071,6 @@ Vector2 get_mouse_position() {
     return result;
 }
 
-float get_mouse_wheel_move() {
-    float x,y;
-    RGFW_getMouseScroll(&x, &y);
-    return y;
-}
-
 Rectangle window_rectangle() {
     int width, height;
     RGFW_window_getSize(win, &width, &height);
@@ -353,198 +1131,3238 @@ void blend_color(uint8_t *buffer, size_t pixel_index, Color c) {
     }
 }
 
-void clear(Color c) {
-    Rectangle screen = window_rectangle();
-    for (size_t i=0; i<screen.height; i++) {
-        for (size_t j=0; j<screen.width; j++) {
-            set_color(pixel_buffer, i*pixel_stride + j, c);
-        }
-    }
+// Span kernels
+//
+// NOTE: all of them work on a run of count consecutive RGBA pixels in dst. The blending kernels
+// expect an opaque destination (which pixel_buffer always is) and then agree bit by bit with
+// blend_color(). With alpha = c.a + 1 blend_color() computes
+//     floor(alpha*c/255 + (256 - alpha)*d/256) = (floor(256*alpha*c/255) + (256 - alpha)*d) >> 8
+// where the right hand side never exceeds 16 bits and floor(y/255) = (y + 1 + (y >> 8)) >> 8
+// for all y <= 255*255, so no division is needed.
+
+uint32_t color_pack(Color c) {
+    uint32_t result;
+    memcpy(&result, &c, sizeof(result));
+    return result;
 }
 
-void draw_image(Draw_Context *ctx, Rectangle dst) {
-    Rectangle screen = window_rectangle();
-    Rectangle image_part = {
-        .width  = dst.width  / ctx->scale,
-        .height = dst.height / ctx->scale,
-        .x = ctx->center.x - 0.5f * dst.width  / ctx->scale,
-        .y = ctx->center.y - 0.5f * dst.height / ctx->scale,
-    };
-    Rectangle dst_to_part = rectangle_multiply(rectangle_invert(dst), image_part);
-    for (int i=MAX(0, dst.y); i<MIN(screen.height, dst.y+dst.height); i++) {
-        for (int j=MAX(0, dst.x); j<MIN(screen.width, dst.x+dst.width); j++) {
-            Vector2 pos = {(float) j, (float) i};
-            pos = rectangle_transform(pos, dst_to_part);
+void fill_span(uint8_t *dst, size_t count, Color c) {
+    uint32_t packed = color_pack(c);
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i v = _mm256_set1_epi32(packed);
+    for (; i+8 <= count; i+=8) _mm256_storeu_si256((__m256i*) &dst[i*4], v);
+#elif defined(__SSE2__)
+    __m128i v = _mm_set1_epi32(packed);
+    for (; i+4 <= count; i+=4) _mm_storeu_si128((__m128i*) &dst[i*4], v);
+#endif
+    for (; i<count; i++) memcpy(&dst[i*4], &packed, sizeof(packed));
+}
 
-            if (in_rectangle(pos, image_rectangle(ctx))) {
-                int index = floorf(pos.y) * ctx->width + floorf(pos.x);
-                Color c = get_color(ctx->pixel_data, index);
-                blend_color(pixel_buffer, i*pixel_stride + j, c);
-            }
-        }
+// blend c over count opaque pixels
+void blend_span(uint8_t *dst, size_t count, Color c) {
+    if (c.a == 0) return;
+    if (c.a == 255) {
+        fill_span(dst, count, c);
+        return;
+    }
+    size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+    unsigned int alpha = (unsigned int)c.a + 1;
+    // per channel constant floor(256*alpha*c/255), the alpha channel becomes 255
+    uint16_t k[4] = {
+        (alpha*c.r*256)/255,
+        (alpha*c.g*256)/255,
+        (alpha*c.b*256)/255,
+        alpha*256,
+    };
+#endif
+#if defined(__AVX2__)
+    __m256i zero = _mm256_setzero_si256();
+    __m256i kv = _mm256_setr_epi16(k[0], k[1], k[2], k[3], k[0], k[1], k[2], k[3], k[0], k[1], k[2], k[3], k[0], k[1], k[2], k[3]);
+    __m256i inv = _mm256_set1_epi16(256 - alpha);
+    for (; i+8 <= count; i+=8) {
+        __m256i d  = _mm256_loadu_si256((__m256i*) &dst[i*4]);
+        __m256i lo = _mm256_srli_epi16(_mm256_add_epi16(kv, _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inv)), 8);
+        __m256i hi = _mm256_srli_epi16(_mm256_add_epi16(kv, _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inv)), 8);
+        _mm256_storeu_si256((__m256i*) &dst[i*4], _mm256_packus_epi16(lo, hi));
+    }
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i kv = _mm_setr_epi16(k[0], k[1], k[2], k[3], k[0], k[1], k[2], k[3]);
+    __m128i inv = _mm_set1_epi16(256 - alpha);
+    for (; i+4 <= count; i+=4) {
+        __m128i d  = _mm_loadu_si128((__m128i*) &dst[i*4]);
+        __m128i lo = _mm_srli_epi16(_mm_add_epi16(kv, _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv)), 8);
+        __m128i hi = _mm_srli_epi16(_mm_add_epi16(kv, _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv)), 8);
+        _mm_storeu_si128((__m128i*) &dst[i*4], _mm_packus_epi16(lo, hi));
     }
+#endif
+    for (; i<count; i++) blend_color(dst, i, c);
 }
 
-void draw_rectangle(Rectangle r, Color c) {
-    Rectangle screen = window_rectangle();
-    for (int i=MAX(0, r.y); i<MIN(screen.height, r.y+r.height); i++) {
-        for (int j=MAX(0, r.x); j<MIN(screen.width, r.x+r.width); j++) {
-            blend_color(pixel_buffer, i*pixel_stride + j, c);
-        }
+#if defined(__AVX2__)
+// blend pixels with their own alpha (unpacked to 16 bit) over opaque pixels
+__m256i blend_pixels_avx2(__m256i s, __m256i d) {
+    __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+    __m256i alpha = _mm256_add_epi16(a, _mm256_set1_epi16(1));
+    __m256i opaque_source = _mm256_or_si256(s, _mm256_set1_epi64x(0x00FF000000000000));
+    __m256i y = _mm256_mullo_epi16(alpha, opaque_source);
+    __m256i q = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(1)), _mm256_srli_epi16(y, 8)), 8);
+    __m256i m = _mm256_mullo_epi16(d, _mm256_sub_epi16(_mm256_set1_epi16(256), alpha));
+    __m256i out = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(y, q), m), 8);
+    __m256i full  = _mm256_cmpeq_epi16(a, _mm256_set1_epi16(255));
+    __m256i empty = _mm256_cmpeq_epi16(a, _mm256_setzero_si256());
+    out = _mm256_or_si256(_mm256_andnot_si256(full, out), _mm256_and_si256(full, s));
+    out = _mm256_or_si256(_mm256_andnot_si256(empty, out), _mm256_and_si256(empty, d));
+    return out;
+}
+#elif defined(__SSE2__)
+// blend pixels with their own alpha (unpacked to 16 bit) over opaque pixels
+__m128i blend_pixels_sse2(__m128i s, __m128i d) {
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+    __m128i alpha = _mm_add_epi16(a, _mm_set1_epi16(1));
+    __m128i opaque_source = _mm_or_si128(s, _mm_set1_epi64x(0x00FF000000000000));
+    __m128i y = _mm_mullo_epi16(alpha, opaque_source);
+    __m128i q = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(y, _mm_set1_epi16(1)), _mm_srli_epi16(y, 8)), 8);
+    __m128i m = _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(256), alpha));
+    __m128i out = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(y, q), m), 8);
+    __m128i full  = _mm_cmpeq_epi16(a, _mm_set1_epi16(255));
+    __m128i empty = _mm_cmpeq_epi16(a, _mm_setzero_si128());
+    out = _mm_or_si128(_mm_andnot_si128(full, out), _mm_and_si128(full, s));
+    out = _mm_or_si128(_mm_andnot_si128(empty, out), _mm_and_si128(empty, d));
+    return out;
+}
+#endif
+
+// the pixel at offset of an image with the given channels as a pixel of pixel_buffer
+Color image_color(const uint8_t *src, size_t offset, int channels) {
+    const uint8_t *p = &src[offset * channels];
+    switch (channels) {
+        case 1:  return (Color) { p[0], p[0], p[0], 255 };
+        case 2:  return (Color) { p[0], p[0], p[0], p[1] };
+        case 3:  return (Color) { p[0], p[1], p[2], 255 };
+        default: return (Color) { p[0], p[1], p[2], p[3] };
     }
 }
 
-Color color_alpha(Color c, float a) {
-    a = fmaxf(a, 0);
-    a = fminf(a, 1);
-    c.a = (uint8_t) (255.0f * a);
-    return c;
+uint32_t image_pixel(const uint8_t *src, size_t offset, int channels) {
+    return color_pack(image_color(src, offset, channels));
 }
 
-void draw(Draw_Context *ctx) {
-    Rectangle screen = window_rectangle();
-    Rectangle image_part = {
-        .width  = screen.width  / ctx->scale,
-        .height = screen.height / ctx->scale,
-        .x = ctx->center.x - 0.5f * screen.width  / ctx->scale,
-        .y = ctx->center.y - 0.5f * screen.height / ctx->scale,
-    };
-    Rectangle screen_to_tex = rectangle_multiply(
-            rectangle_invert(screen),
-            image_part
-            );
-    Rectangle tex_to_screen = rectangle_invert(screen_to_tex);
+// the inverse of image_color, gray pixels take the green channel of c
+void set_image_color(uint8_t *dst, size_t offset, int channels, Color c) {
+    uint8_t *p = &dst[offset * channels];
+    if (channels <= 2) {
+        p[0] = c.g;
+        if (channels == 2) p[1] = c.a;
+    } else {
+        memcpy(p, &c, channels);
+    }
+}
 
-    Vector2 mouse_screen = get_mouse_position();
+void blend_image_color(uint8_t *dst, size_t offset, int channels, Color c) {
+    Color pixel = image_color(dst, offset, channels);
+    blend_color((uint8_t*) &pixel, 0, c);
+    set_image_color(dst, offset, channels, pixel);
+}
 
-    draw_image(ctx, screen);
+// the filled pixels are copied over the rest, so that they double every time
+void fill_image_span(uint8_t *dst, size_t count, int channels, Color c) {
+    if (count == 0) return;
+    set_image_color(dst, 0, channels, c);
+    for (size_t done=1; done<count; done*=2) memcpy(&dst[done*channels], dst, MIN(done, count-done)*channels);
+}
 
-    for (size_t i=0; i< ctx->stack.cursor/2; i++) {
-        Rectangle r = hull(
-                rectangle_transform(ctx->stack.items[2*i+0], tex_to_screen),
-                rectangle_transform(ctx->stack.items[2*i+1], tex_to_screen)
-                );
-        draw_rectangle(r, block_color);
+#if defined(__AVX2__)
+// the pixels src[index[0]], ..., src[index[7]] of an image with the given channels as pixels of
+// pixel_buffer, narrow pixels are read as 4 bytes and then spread over the channels
+__m256i gather_pixels_avx2(const uint8_t *src, __m256i index, int channels) {
+    if (channels == 4) return _mm256_i32gather_epi32((const int*) src, index, 4);
+    __m256i v;
+    if (channels == 3) {
+        v = _mm256_i32gather_epi32((const int*) src, _mm256_mullo_epi32(index, _mm256_set1_epi32(3)), 1);
+    } else if (channels == 2) {
+        v = _mm256_i32gather_epi32((const int*) src, index, 2);
+    } else {
+        v = _mm256_i32gather_epi32((const int*) src, index, 1);
     }
+    static const int8_t shuffles[3][32] = {
+        { 0, 0, 0, -1, 4, 4, 4, -1, 8, 8,  8, -1, 12, 12, 12, -1,  0, 0, 0, -1, 4, 4, 4, -1, 8, 8,  8, -1, 12, 12, 12, -1 }, // gray
+        { 0, 0, 0,  1, 4, 4, 4,  5, 8, 8,  8,  9, 12, 12, 12, 13,  0, 0, 0,  1, 4, 4, 4,  5, 8, 8,  8,  9, 12, 12, 12, 13 }, // gray and alpha
+        { 0, 1, 2, -1, 4, 5, 6, -1, 8, 9, 10, -1, 12, 13, 14, -1,  0, 1, 2, -1, 4, 5, 6, -1, 8, 9, 10, -1, 12, 13, 14, -1 }, // RGB
+    };
+    __m256i shuffle = _mm256_loadu_si256((const __m256i*) shuffles[channels - 1]);
+    __m256i alpha = _mm256_set1_epi32(channels == 2 ? 0 : 0xFF000000);
+    return _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha);
+}
+#endif
 
-    if (ctx->stack.cursor % 2 == 1) {
-        Rectangle preview = hull(
-                rectangle_transform(ctx->stack.items[ctx->stack.cursor-1], tex_to_screen),
-                mouse_screen
-                );
-        draw_rectangle(preview, color_alpha(block_color, 0.7));
+// blend the pixels src[columns[0]], ..., src[columns[count-1]] over count opaque pixels
+void blend_image_span(uint8_t *dst, const uint8_t *src, int channels, const int *columns, size_t count) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i zero = _mm256_setzero_si256();
+    for (; i+8 <= count; i+=8) {
+        __m256i index = _mm256_loadu_si256((__m256i*) &columns[i]);
+        __m256i s = gather_pixels_avx2(src, index, channels);
+        __m256i d = _mm256_loadu_si256((__m256i*) &dst[i*4]);
+        __m256i lo = blend_pixels_avx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+        __m256i hi = blend_pixels_avx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+        _mm256_storeu_si256((__m256i*) &dst[i*4], _mm256_packus_epi16(lo, hi));
     }
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    for (; i+4 <= count; i+=4) {
+        __m128i s = _mm_setr_epi32(
+            image_pixel(src, columns[i+0], channels), image_pixel(src, columns[i+1], channels),
+            image_pixel(src, columns[i+2], channels), image_pixel(src, columns[i+3], channels));
+        __m128i d = _mm_loadu_si128((__m128i*) &dst[i*4]);
+        __m128i lo = blend_pixels_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i hi = blend_pixels_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        _mm_storeu_si128((__m128i*) &dst[i*4], _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i<count; i++) blend_color(dst, i, image_color(src, columns[i], channels));
 }
 
-void undo(Draw_Context *ctx) {
+// copy the pixels src[columns[0]], ..., src[columns[count-1]] without blending
+void copy_image_span(uint8_t *dst, const uint8_t *src, int channels, const int *columns, size_t count) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i+8 <= count; i+=8) {
+        __m256i index = _mm256_loadu_si256((__m256i*) &columns[i]);
+        _mm256_storeu_si256((__m256i*) &dst[i*4], gather_pixels_avx2(src, index, channels));
+    }
+#endif
+    if (channels == 4) {
+        const uint32_t *src32 = (const uint32_t*) src;
+        for (; i<count; i++) memcpy(&dst[i*4], &src32[columns[i]], sizeof(*src32));
+    }
+    for (; i<count; i++) set_color(dst, i, image_color(src, columns[i], channels));
+}
+
+// NOTE: the bilinear filter weights out of 128, so every intermediate result fits into 16 bits.
+// Every channel is interpolated on its own, first between the columns and then between the rows
+Color bilinear(const uint8_t *top, const uint8_t *bottom, int channels, int column, int next_column, unsigned int wx, unsigned int wy) {
+    Color taps[4] = {
+        image_color(top, column, channels),    image_color(top, next_column, channels),
+        image_color(bottom, column, channels), image_color(bottom, next_column, channels),
+    };
+    uint8_t result[4];
+    for (size_t c=0; c<4; c++) {
+        const uint8_t *t0 = (const uint8_t*) &taps[0], *t1 = (const uint8_t*) &taps[1];
+        const uint8_t *b0 = (const uint8_t*) &taps[2], *b1 = (const uint8_t*) &taps[3];
+        unsigned int t = (t0[c] * (128 - wx) + t1[c] * wx + 64) >> 7;
+        unsigned int b = (b0[c] * (128 - wx) + b1[c] * wx + 64) >> 7;
+        result[c] = (t * (128 - wy) + b * wy + 64) >> 7;
+    }
+    Color color;
+    memcpy(&color, result, sizeof(color));
+    return color;
+}
+
+#if defined(__AVX2__)
+__m256i lerp_avx2(__m256i a, __m256i b, __m256i w) {
+    __m256i r = _mm256_add_epi16(_mm256_mullo_epi16(a, _mm256_sub_epi16(_mm256_set1_epi16(128), w)), _mm256_mullo_epi16(b, w));
+    return _mm256_srli_epi16(_mm256_add_epi16(r, _mm256_set1_epi16(64)), 7);
+}
+#elif defined(__SSE2__)
+__m128i lerp_sse2(__m128i a, __m128i b, __m128i w) {
+    __m128i r = _mm_add_epi16(_mm_mullo_epi16(a, _mm_sub_epi16(_mm_set1_epi16(128), w)), _mm_mullo_epi16(b, w));
+    return _mm_srli_epi16(_mm_add_epi16(r, _mm_set1_epi16(64)), 7);
+}
+#endif
+
+// bilinear samples between the rows top and bottom for the first count columns of the sampler,
+// unless opaque they are blended over background
+void filter_image_span(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, const Image_Sampler *sampler, unsigned int wy, size_t count, bool opaque, Color background) {
+    const int *columns = sampler->columns;
+    const int *next_columns = sampler->next_columns;
+    const uint16_t *weights = sampler->weights;
+    int channels = sampler->image.channels;
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i zero = _mm256_setzero_si256();
+    __m256i vy = _mm256_set1_epi16(wy);
+    __m256i bg = _mm256_unpacklo_epi8(_mm256_set1_epi32(color_pack(background)), zero);
+    for (; i+8 <= count; i+=8) {
+        __m256i index      = _mm256_loadu_si256((__m256i*) &columns[i]);
+        __m256i next_index = _mm256_loadu_si256((__m256i*) &next_columns[i]);
+        __m256i t0 = gather_pixels_avx2(top,    index,      channels);
+        __m256i t1 = gather_pixels_avx2(top,    next_index, channels);
+        __m256i b0 = gather_pixels_avx2(bottom, index,      channels);
+        __m256i b1 = gather_pixels_avx2(bottom, next_index, channels);
+        // spread the weight of every pixel over its four channels
+        __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i*) &weights[i]));
+        w = _mm256_or_si256(w, _mm256_slli_epi32(w, 16));
+        __m256i w_lo = _mm256_unpacklo_epi32(w, w);
+        __m256i w_hi = _mm256_unpackhi_epi32(w, w);
+        __m256i lo = lerp_avx2(
+                lerp_avx2(_mm256_unpacklo_epi8(t0, zero), _mm256_unpacklo_epi8(t1, zero), w_lo),
+                lerp_avx2(_mm256_unpacklo_epi8(b0, zero), _mm256_unpacklo_epi8(b1, zero), w_lo), vy);
+        __m256i hi = lerp_avx2(
+                lerp_avx2(_mm256_unpackhi_epi8(t0, zero), _mm256_unpackhi_epi8(t1, zero), w_hi),
+                lerp_avx2(_mm256_unpackhi_epi8(b0, zero), _mm256_unpackhi_epi8(b1, zero), w_hi), vy);
+        if (!opaque) {
+            lo = blend_pixels_avx2(lo, bg);
+            hi = blend_pixels_avx2(hi, bg);
+        }
+        _mm256_storeu_si256((__m256i*) &dst[i*4], _mm256_packus_epi16(lo, hi));
+    }
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i vy = _mm_set1_epi16(wy);
+    __m128i bg = _mm_unpacklo_epi8(_mm_set1_epi32(color_pack(background)), zero);
+    int k = channels;
+    for (; i+4 <= count; i+=4) {
+        const int *c = &columns[i], *n = &next_columns[i];
+        __m128i t0 = _mm_setr_epi32(image_pixel(top, c[0], k),    image_pixel(top, c[1], k),    image_pixel(top, c[2], k),    image_pixel(top, c[3], k));
+        __m128i t1 = _mm_setr_epi32(image_pixel(top, n[0], k),    image_pixel(top, n[1], k),    image_pixel(top, n[2], k),    image_pixel(top, n[3], k));
+        __m128i b0 = _mm_setr_epi32(image_pixel(bottom, c[0], k), image_pixel(bottom, c[1], k), image_pixel(bottom, c[2], k), image_pixel(bottom, c[3], k));
+        __m128i b1 = _mm_setr_epi32(image_pixel(bottom, n[0], k), image_pixel(bottom, n[1], k), image_pixel(bottom, n[2], k), image_pixel(bottom, n[3], k));
+        // spread the weight of every pixel over its four channels
+        __m128i w = _mm_loadl_epi64((__m128i*) &weights[i]);
+        w = _mm_unpacklo_epi16(w, w);
+        __m128i w_lo = _mm_unpacklo_epi32(w, w);
+        __m128i w_hi = _mm_unpackhi_epi32(w, w);
+        __m128i lo = lerp_sse2(
+                lerp_sse2(_mm_unpacklo_epi8(t0, zero), _mm_unpacklo_epi8(t1, zero), w_lo),
+                lerp_sse2(_mm_unpacklo_epi8(b0, zero), _mm_unpacklo_epi8(b1, zero), w_lo), vy);
+        __m128i hi = lerp_sse2(
+                lerp_sse2(_mm_unpackhi_epi8(t0, zero), _mm_unpackhi_epi8(t1, zero), w_hi),
+                lerp_sse2(_mm_unpackhi_epi8(b0, zero), _mm_unpackhi_epi8(b1, zero), w_hi), vy);
+        if (!opaque) {
+            lo = blend_pixels_sse2(lo, bg);
+            hi = blend_pixels_sse2(hi, bg);
+        }
+        _mm_storeu_si128((__m128i*) &dst[i*4], _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i<count; i++) {
+        Color c = bilinear(top, bottom, channels, columns[i], next_columns[i], weights[i], wy);
+        if (opaque) {
+            memcpy(&dst[i*4], &c, sizeof(c));
+        } else {
+            fill_span(&dst[i*4], 1, background);
+            blend_color(dst, i, c);
+        }
+    }
+}
+
+// NOTE: every drawing function only touches the pixels inside of clip,
+// clip is expected to have integer coordinates and to lie inside of the window
+
+void clear(uint8_t *buffer, Rectangle clip, Color c) {
+    for (int i=clip.y; i<clip.y+clip.height; i++) {
+        fill_span(&buffer[(i*pixel_stride + (int) clip.x)*4], clip.width, c);
+    }
+}
+
+// clear the part of clip that is not covered by the image of sampler
+void clear_letterbox(uint8_t *buffer, Image_Sampler *sampler, Rectangle clip, Color c) {
+    int x0 = clip.x, x1 = clip.x + clip.width;
+    int y0 = clip.y, y1 = clip.y + clip.height;
+    int image_y0 = MAX(y0, MIN(y1, sampler->y0));
+    int image_y1 = MAX(image_y0, MIN(y1, sampler->y1));
+    for (int i=y0; i<y1; i++) {
+        uint8_t *row = &buffer[(i*pixel_stride + x0)*4];
+        if (i < image_y0 || i >= image_y1) {
+            fill_span(row, x1 - x0, c);
+        } else {
+            fill_span(row, sampler->x0 - x0, c);
+            fill_span(&row[(sampler->x1 - x0)*4], x1 - sampler->x1, c);
+        }
+    }
+}
+
+// the part of [lo, hi) that is mapped into [0, size) at the given level
+void sample_range(Axis_Mapping m, int level, int size, int lo, int hi, int *first, int *last) {
+    *first = MIN(MAX(axis_pixel(m, 0, level), lo), hi);
+    *last  = MIN(MAX(axis_pixel(m, size, level), *first), hi);
+}
+
+Image_Sampler image_sampler(Draw_Context *ctx, View_Mapping map, Rectangle clip, Arena *arena) {
+    Image_Sampler result = {
+        .quality = quality,
+        .map = map,
+    };
+
+    // sample the smallest mipmap that still has at least one texel per screen pixel
+    int level = 0;
+    while (level < MIPMAP_CAPACITY && ctx->scale * (2 << level) <= 1.0f) level++;
+    result.level = level;
+    result.image = draw_context_level(ctx, level);
+
+    // NOTE: the mapping is an axis aligned scale and offset, so the source column only depends
+    // on the screen column and the source row only on the screen row
+    sample_range(map.x, level, result.image.width,  clip.x, clip.x+clip.width,  &result.x0, &result.x1);
+    sample_range(map.y, level, result.image.height, clip.y, clip.y+clip.height, &result.y0, &result.y1);
+    if (result.x0 >= result.x1 || result.y0 >= result.y1) {
+        result.y1 = result.y0;
+        return result;
+    }
+
+    size_t count = result.x1 - result.x0;
+    result.columns = arena_alloc(arena, sizeof(*result.columns) * count);
+    if (quality == QUALITY_FILTERED) {
+        // NOTE: filtering works with pixel centers, where the nearest neighbour works with corners
+        result.next_columns = arena_alloc(arena, sizeof(*result.next_columns) * count);
+        result.weights      = arena_alloc(arena, sizeof(*result.weights) * count);
+        Fixed max = (Fixed) (result.image.width - 1) << FIXED_SHIFT;
+        Fixed u = map.x.step * result.x0 + map.x.offset + map.x.step / 2;
+        for (size_t k=0; k<count; k++, u+=map.x.step) {
+            Fixed center = MIN(MAX((u >> level) - FIXED_ONE / 2, 0), max);
+            int x = center >> FIXED_SHIFT;
+            result.columns[k]      = column_offset(result.image.width, result.image.height, x);
+            result.next_columns[k] = column_offset(result.image.width, result.image.height, MIN(x + 1, (int) result.image.width - 1));
+            result.weights[k]      = ((center & (FIXED_ONE - 1)) + (FIXED_ONE >> 8)) >> (FIXED_SHIFT - 7);
+        }
+        return result;
+    }
+
+    result.contiguous = quality == QUALITY_NEAREST; // true at scale 1, where every row is a plain memcpy
+    Fixed u = map.x.step * result.x0 + map.x.offset;
+    for (size_t k=0; k<count; k++, u+=map.x.step) {
+        if (quality == QUALITY_FAST && k > 0 && ((result.x0 + k) & 1)) {
+            result.columns[k] = result.columns[k-1];
+        } else {
+            result.columns[k] = column_offset(result.image.width, result.image.height, u >> (FIXED_SHIFT + level));
+        }
+        result.contiguous = result.contiguous && result.columns[k] == result.columns[0] + (int) k;
+    }
+    return result;
+}
+
+void draw_filtered_rows(uint8_t *buffer, Image_Sampler *sampler, int y0, int y1, Color background) {
+    Mipmap image = sampler->image;
+    int x0 = sampler->x0, x1 = sampler->x1;
+    Axis_Mapping m = sampler->map.y;
+    Fixed max = (Fixed) (image.height - 1) << FIXED_SHIFT;
+    for (int i=MAX(y0, sampler->y0); i<MIN(y1, sampler->y1); i++) {
+        Fixed center = MIN(MAX(((m.step * i + m.offset + m.step / 2) >> sampler->level) - FIXED_ONE / 2, 0), max);
+        int row = center >> FIXED_SHIFT;
+        int next_row = MIN(row + 1, (int) image.height - 1);
+        unsigned int wy = ((center & (FIXED_ONE - 1)) + (FIXED_ONE >> 8)) >> (FIXED_SHIFT - 7);
+        uint8_t *top    = &image.pixel_data[row_offset(image.width, image.height, row) * image.channels];
+        uint8_t *bottom = &image.pixel_data[row_offset(image.width, image.height, next_row) * image.channels];
+        uint8_t *dst_row = &buffer[(i*pixel_stride + x0)*4];
+        bool opaque = image.opaque_bands[row / OPAQUE_BAND_HEIGHT] && image.opaque_bands[next_row / OPAQUE_BAND_HEIGHT];
+        filter_image_span(dst_row, top, bottom, sampler, wy, x1 - x0, opaque, background);
+    }
+}
+
+// draw the screen rows [y0, y1) of what the sampler covers,
+// translucent parts of the image are blended over background
+void draw_image_rows(uint8_t *buffer, Image_Sampler *sampler, int y0, int y1, Color background) {
+    if (sampler->quality == QUALITY_FILTERED) {
+        draw_filtered_rows(buffer, sampler, y0, y1, background);
+        return;
+    }
+    Mipmap image = sampler->image;
+    int x0 = sampler->x0, x1 = sampler->x1;
+    int last_row = -1;
+    for (int i=MAX(y0, sampler->y0); i<MIN(y1, sampler->y1); i++) {
+        int sample = sampler->quality == QUALITY_FAST ? MAX(i & ~1, sampler->y0) : i;
+        int row = axis_texel(sampler->map.y, sample, sampler->level);
+        uint8_t *src = &image.pixel_data[row_offset(image.width, image.height, row) * image.channels];
+        uint8_t *dst_row = &buffer[(i*pixel_stride + x0)*4];
+        if (!image.opaque_bands[row / OPAQUE_BAND_HEIGHT]) {
+            fill_span(dst_row, x1 - x0, background);
+            blend_image_span(dst_row, src, image.channels, sampler->columns, x1 - x0);
+            last_row = -1;
+        } else if (row == last_row) {
+            // when zoomed in consecutive screen rows show the same source row
+            memcpy(dst_row, dst_row - pixel_stride*4, (x1 - x0)*4);
+        } else if (sampler->contiguous && image.channels == 4) {
+            memcpy(dst_row, &src[sampler->columns[0]*4], (x1 - x0)*4);
+            last_row = row;
+        } else {
+            copy_image_span(dst_row, src, image.channels, sampler->columns, x1 - x0);
+            last_row = row;
+        }
+    }
+}
+
+void copy_rectangle(uint8_t *dst, uint8_t *src, Rectangle clip) {
+    for (int i=clip.y; i<clip.y+clip.height; i++) {
+        size_t offset = (i*pixel_stride + (int) clip.x)*4;
+        memcpy(&dst[offset], &src[offset], clip.width*4);
+    }
+}
+
+// NOTE: a pixel is covered when its center lies inside of r, rounding the edges keeps
+// the result stable when r moves by whole pixels (e.g. when the content is scrolled)
+void draw_rectangle(uint8_t *buffer, Rectangle r, Color c, Rectangle clip) {
+    int x0 = MAX(clip.x, roundf(r.x));
+    int y0 = MAX(clip.y, roundf(r.y));
+    int x1 = MIN(clip.x+clip.width,  roundf(r.x+r.width));
+    int y1 = MIN(clip.y+clip.height, roundf(r.y+r.height));
+    if (x0 >= x1) return;
+    for (int i=y0; i<y1; i++) {
+        blend_span(&buffer[(i*pixel_stride + x0)*4], x1 - x0, c);
+    }
+}
+
+int rectangle_compare_y(const void *a, const void *b) {
+    float ya = ((const Rectangle*) a)->y, yb = ((const Rectangle*) b)->y;
+    return (ya > yb) - (ya < yb);
+}
+
+int int_compare(const void *a, const void *b) {
+    int ia = *(const int*) a, ib = *(const int*) b;
+    return (ia > ib) - (ia < ib);
+}
+
+// the pixels inside of clip that are covered by any of the rectangles, they are rounded like in
+// draw_rectangle. Sweeps over the top and bottom edges and merges the rectangles that are active
+// between two of them.
+Coverage coverage(Rectangle *rects, size_t count, Rectangle clip, Arena *arena) {
+    Coverage result = {0};
+    if (count == 0) return result;
+    Rectangle *boxes = arena_alloc(arena, sizeof(*boxes) * count);
+    int *edges = arena_alloc(arena, sizeof(*edges) * 2*count);
+    size_t box_count = 0;
+    for (size_t i=0; i<count; i++) {
+        Rectangle r = rects[i];
+        int x0 = MAX(clip.x, roundf(r.x));
+        int y0 = MAX(clip.y, roundf(r.y));
+        int x1 = MIN(clip.x+clip.width,  roundf(r.x+r.width));
+        int y1 = MIN(clip.y+clip.height, roundf(r.y+r.height));
+        if (x0 >= x1 || y0 >= y1) continue;
+        boxes[box_count] = (Rectangle) { .x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0 };
+        edges[2*box_count + 0] = y0;
+        edges[2*box_count + 1] = y1;
+        box_count++;
+    }
+    if (box_count == 0) return result;
+    qsort(boxes, box_count, sizeof(*boxes), rectangle_compare_y);
+    qsort(edges, 2*box_count, sizeof(*edges), int_compare);
+
+    result.items = arena_alloc(arena, sizeof(*result.items) * 2*box_count);
+    Rectangle *active = arena_alloc(arena, sizeof(*active) * box_count); // sorted by x
+    Span *merged = arena_alloc(arena, sizeof(*merged) * box_count);
+    size_t active_count = 0, next = 0;
+    for (size_t e=0; e+1<2*box_count; e++) {
+        int y0 = edges[e], y1 = edges[e+1];
+        if (y0 == y1) continue;
+
+        size_t kept = 0;
+        for (size_t k=0; k<active_count; k++) {
+            if (active[k].y + active[k].height > y0) active[kept++] = active[k];
+        }
+        active_count = kept;
+        for (; next<box_count && boxes[next].y <= y0; next++) {
+            size_t k = active_count++;
+            for (; k>0 && active[k-1].x > boxes[next].x; k--) active[k] = active[k-1];
+            active[k] = boxes[next];
+        }
+        if (active_count == 0) continue;
+
+        size_t span_count = 0;
+        for (size_t k=0; k<active_count; k++) {
+            int x0 = active[k].x, x1 = active[k].x + active[k].width;
+            if (span_count > 0 && x0 <= merged[span_count-1].x1) {
+                merged[span_count-1].x1 = MAX(merged[span_count-1].x1, x1);
+            } else {
+                merged[span_count++] = (Span) { x0, x1 };
+            }
+        }
+        Coverage_Band *band = &result.items[result.count++];
+        band->y0 = y0;
+        band->y1 = y1;
+        band->count = span_count;
+        band->spans = arena_alloc(arena, sizeof(*band->spans) * span_count);
+        memcpy(band->spans, merged, sizeof(*band->spans) * span_count);
+    }
+    return result;
+}
+
+// blend c over the pixels of coverage inside of clip
+void draw_coverage(uint8_t *buffer, Coverage *coverage, Color c, Rectangle clip) {
+    int clip_x0 = clip.x, clip_x1 = clip.x + clip.width;
+    for (size_t b=0; b<coverage->count; b++) {
+        Coverage_Band *band = &coverage->items[b];
+        int y0 = MAX(clip.y, band->y0);
+        int y1 = MIN(clip.y+clip.height, band->y1);
+        for (int i=y0; i<y1; i++) {
+            for (size_t k=0; k<band->count; k++) {
+                int x0 = MAX(clip_x0, band->spans[k].x0);
+                int x1 = MIN(clip_x1, band->spans[k].x1);
+                if (x0 < x1) blend_span(&buffer[(i*pixel_stride + x0)*4], x1 - x0, c);
+            }
+        }
+    }
+}
+
+Color color_alpha(Color c, float a) {
+    a = fmaxf(a, 0);
+    a = fminf(a, 1);
+    c.a = (uint8_t) (255.0f * a);
+    return c;
+}
+
+void *pool_worker(void *arg) {
+    Worker_Pool *pool = arg;
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->quit && pool->next_task >= pool->task_count) {
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        }
+        if (pool->quit) break;
+        size_t index = pool->next_task++;
+        pthread_mutex_unlock(&pool->mutex);
+        pool->task(pool->arg, index);
+        pthread_mutex_lock(&pool->mutex);
+        pool->finished_tasks++;
+        if (pool->finished_tasks == pool->task_count) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+void pool_init(Worker_Pool *pool, size_t thread_count) {
+    if (thread_count == 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = processors > 0 ? processors : 1;
+    }
+    pool->thread_count = thread_count;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->threads = arena_alloc(&global_arena, sizeof(*pool->threads) * thread_count);
+    for (size_t i=1; i<thread_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+            printf("[ERROR] could not create worker thread\n");
+            exit(1);
+        }
+    }
+}
+
+// runs task(arg, 0), ..., task(arg, count-1) and returns when all of them are done
+void pool_run(Worker_Pool *pool, Task task, void *arg, size_t count) {
+    if (pool->thread_count <= 1 || count <= 1) {
+        for (size_t i=0; i<count; i++) task(arg, i);
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->task = task;
+    pool->arg = arg;
+    pool->task_count = count;
+    pool->next_task = 0;
+    pool->finished_tasks = 0;
+    pthread_cond_broadcast(&pool->start);
+    while (pool->next_task < pool->task_count) {
+        size_t index = pool->next_task++;
+        pthread_mutex_unlock(&pool->mutex);
+        task(arg, index);
+        pthread_mutex_lock(&pool->mutex);
+        pool->finished_tasks++;
+    }
+    while (pool->finished_tasks < pool->task_count) {
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_free(Worker_Pool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for (size_t i=1; i<pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+}
+
+View_Mapping view_mapping(Draw_Context *ctx) {
+    Rectangle screen = window_rectangle();
+    double step = 1.0 / ctx->scale;
+    View_Mapping result = {
+        .x = {
+            .step   = fixed_from_double(step),
+            .offset = fixed_from_double(ctx->center.x - 0.5 * screen.width * step),
+        },
+        .y = {
+            .step   = fixed_from_double(step),
+            .offset = fixed_from_double(ctx->center.y - 0.5 * screen.height * step),
+        },
+    };
+    return result;
+}
+
+Vector2 screen_to_texel(View_Mapping map, Vector2 v) {
+    Vector2 result = {
+        .x = fixed_to_double(map.x.step * (Fixed) v.x + map.x.offset),
+        .y = fixed_to_double(map.y.step * (Fixed) v.y + map.y.offset),
+    };
+    return result;
+}
+
+// the texels whose centers lie inside of the hull of a and b
+Texel_Rectangle texel_rectangle(Draw_Context *ctx, Vector2 a, Vector2 b) {
+    Rectangle r = hull(a, b);
+    Texel_Rectangle result = {
+        .x0 = MAX(0, ceilf(r.x - 0.5f)),
+        .y0 = MAX(0, ceilf(r.y - 0.5f)),
+        .x1 = MIN((int) ctx->width,  ceilf(r.x + r.width  - 0.5f)),
+        .y1 = MIN((int) ctx->height, ceilf(r.y + r.height - 0.5f)),
+    };
+    return result;
+}
+
+// the screen pixels that show the texels of t
+Rectangle texel_to_screen(View_Mapping map, Texel_Rectangle t) {
+    Rectangle result = {0};
+    if (t.x0 >= t.x1 || t.y0 >= t.y1) return result;
+    result.x = axis_pixel(map.x, t.x0, 0);
+    result.y = axis_pixel(map.y, t.y0, 0);
+    result.width  = axis_pixel(map.x, t.x1, 0) - result.x;
+    result.height = axis_pixel(map.y, t.y1, 0) - result.y;
+    return result;
+}
+
+Texel_Rectangle block_texels(Draw_Context *ctx, size_t i) {
+    return ctx->grid.texels[i];
+}
+
+// screen rectangle of the i-th committed block
+Rectangle block_rectangle(Draw_Context *ctx, View_Mapping map, size_t i) {
+    return texel_to_screen(map, block_texels(ctx, i));
+}
+
+// screen rectangle of the block that is currently dragged out, if there is one,
+// it covers exactly what the block covers once it is committed
+bool preview_rectangle(Draw_Context *ctx, View_Mapping map, Rectangle *preview) {
+    if (ctx->stack.cursor % 2 == 0) return false;
+    Vector2 mouse_tex = screen_to_texel(map, get_mouse_position());
+    *preview = texel_to_screen(map, texel_rectangle(ctx, ctx->stack.items[ctx->stack.cursor-1], mouse_tex));
+    return true;
+}
+
+// NOTE: allocates from frame_arena, the job is valid until it is rewound
+Draw_Job draw_job(Draw_Context *ctx, Rectangle clip, bool base) {
+    Draw_Job result = {
+        .clip = clip,
+        .base = base,
+        .map = view_mapping(ctx),
+    };
+    if (base) {
+        result.sampler = image_sampler(ctx, result.map, clip, &frame_arena);
+        // the texels shown by the pixels of clip, a block is drawn in clip iff it covers one of them
+        Texel_Rectangle area = {
+            .x0 = axis_texel(result.map.x, clip.x, 0),
+            .y0 = axis_texel(result.map.y, clip.y, 0),
+            .x1 = axis_texel(result.map.x, clip.x + clip.width  - 1, 0) + 1,
+            .y1 = axis_texel(result.map.y, clip.y + clip.height - 1, 0) + 1,
+        };
+        size_t limit = ctx->stack.cursor/2;
+        size_t *visible = arena_alloc(&frame_arena, sizeof(*visible) * MAX(limit, 1));
+        size_t visible_count = block_grid_query(&ctx->grid, area, limit, visible);
+        Rectangle *rects = arena_alloc(&frame_arena, sizeof(*rects) * MAX(visible_count, 1));
+        for (size_t k=0; k<visible_count; k++) rects[k] = block_rectangle(ctx, result.map, visible[k]);
+        result.blocks = coverage(rects, visible_count, clip, &frame_arena);
+    }
+    result.has_preview = preview_rectangle(ctx, result.map, &result.preview);
+    return result;
+}
+
+// draw the part of the job inside of band
+//
+// NOTE: the window is composed of two layers, the base layer in base_buffer holds the image and
+// the committed blocks and only has to be redrawn when one of them changes. The preview is drawn
+// on top of a copy of it, so dragging out a block costs time proportional to the preview's area.
+// The blocks change with the generation of Draw_Context, damage_frame marks the area of the
+// changed ones as base damage.
+void draw_band(Draw_Job *job, Rectangle band) {
+    Color background = native_color(BACKGROUND_COLOR);
+    Color block = native_color(block_color);
+    if (job->base) {
+        clear_letterbox(base_buffer, &job->sampler, band, background);
+        draw_image_rows(base_buffer, &job->sampler, band.y, band.y+band.height, background);
+        draw_coverage(base_buffer, &job->blocks, block, band);
+    }
+
+    copy_rectangle(pixel_buffer, base_buffer, band);
+    if (job->has_preview) {
+        draw_rectangle(pixel_buffer, job->preview, color_alpha(block, 0.7), band);
+    }
+}
+
+size_t band_count(Rectangle clip) {
+    return MAX(1, MIN(pool.thread_count, (size_t) clip.height / MIN_BAND_HEIGHT));
+}
+
+// the index-th of band_count(clip) horizontal bands of clip
+Rectangle band_rectangle(Rectangle clip, size_t index) {
+    size_t count = band_count(clip);
+    int y0 = clip.y + (int) clip.height * index / count;
+    int y1 = clip.y + (int) clip.height * (index + 1) / count;
+    Rectangle result = {
+        .x = clip.x, .y = y0,
+        .width = clip.width, .height = y1 - y0,
+    };
+    return result;
+}
+
+void draw_band_task(void *arg, size_t index) {
+    Draw_Job *job = arg;
+    draw_band(job, band_rectangle(job->clip, index));
+}
+
+// draw everything inside of clip, base tells whether the base layer is outdated there as well
+void draw(Draw_Context *ctx, Rectangle clip, bool base) {
+    Arena_Mark mark = arena_snapshot(&frame_arena);
+    Draw_Job job = draw_job(ctx, clip, base);
+    pool_run(&pool, draw_band_task, &job, band_count(clip));
+    arena_rewind(&frame_arena, mark);
+}
+
+Frame_State frame_state(Draw_Context *ctx) {
+    Frame_State result = {
+        .center = ctx->center,
+        .scale  = ctx->scale,
+        .screen = window_rectangle(),
+        .cursor = ctx->stack.cursor,
+        .generation = ctx->generation,
+        .quality = quality,
+    };
+    result.has_preview = preview_rectangle(ctx, view_mapping(ctx), &result.preview);
+    return result;
+}
+
+double time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+bool frame_state_equal(Frame_State a, Frame_State b) {
+    return a.center.x == b.center.x && a.center.y == b.center.y
+        && a.scale == b.scale
+        && rectangle_equal(a.screen, b.screen)
+        && a.cursor == b.cursor
+        && a.generation == b.generation
+        && a.quality == b.quality
+        && a.has_preview == b.has_preview
+        && (!a.has_preview || rectangle_equal(a.preview, b.preview));
+}
+
+// base tells whether the base layer under r changed or only the preview
+void damage_add(Damage *damage, Rectangle r, bool base) {
+    if (damage->full) return;
+    r = rectangle_intersect(rectangle_snap(r), window_rectangle());
+    if (rectangle_empty(r)) return;
+
+    // merge with everything r touches so the items stay disjoint
+    for (size_t i=0; i<damage->count;) {
+        if (rectangle_overlaps(damage->items[i], r)) {
+            r = rectangle_union(r, damage->items[i]);
+            base = base || damage->base[i];
+            damage->count--;
+            damage->items[i] = damage->items[damage->count];
+            damage->base[i]  = damage->base[damage->count];
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+    if (damage->count == DAMAGE_CAPACITY) {
+        damage->full = true;
+        return;
+    }
+    damage->items[damage->count] = r;
+    damage->base[damage->count] = base;
+    damage->count++;
+}
+
+// move the content of buffer by (dx, dy) pixels
+void scroll(uint8_t *buffer, int dx, int dy) {
+    Rectangle screen = window_rectangle();
+    int width  = screen.width  - ABS(dx);
+    int height = screen.height - ABS(dy);
+    int src_x = MAX(0, -dx), dst_x = MAX(0, dx);
+    if (dy > 0) {
+        for (int i=height-1; i>=0; i--) {
+            memmove(&buffer[((i+dy)*pixel_stride + dst_x)*4], &buffer[(i*pixel_stride + src_x)*4], width*4);
+        }
+    } else {
+        for (int i=0; i<height; i++) {
+            memmove(&buffer[(i*pixel_stride + dst_x)*4], &buffer[((i-dy)*pixel_stride + src_x)*4], width*4);
+        }
+    }
+}
+
+// compare what is on the screen with what should be on the screen and record the difference
+void damage_frame(Damage *damage, Draw_Context *ctx, Frame_State old, Frame_State new) {
+    Texel_Rectangle replaced = ctx->replaced;
+    ctx->replaced = (Texel_Rectangle) {0};
+    if (damage->full) return;
+    // NOTE: a lower quality can be drawn next to what is shown, it is refined later anyways
+    if (!rectangle_equal(old.screen, new.screen) || old.scale != new.scale || new.quality > old.quality) {
+        damage->full = true;
+        return;
+    }
+
+    Rectangle screen = new.screen;
+    View_Mapping map = view_mapping(ctx);
+
+    if (old.center.x != new.center.x || old.center.y != new.center.y) {
+        // a pan by whole pixels keeps the old content valid, it just moved on the screen
+        float fx = (old.center.x - new.center.x) * new.scale;
+        float fy = (old.center.y - new.center.y) * new.scale;
+        int dx = roundf(fx);
+        int dy = roundf(fy);
+        if (fabsf(fx - dx) > 1e-2 || fabsf(fy - dy) > 1e-2 || ABS(dx) >= screen.width || ABS(dy) >= screen.height) {
+            damage->full = true;
+            return;
+        }
+        scroll(pixel_buffer, dx, dy);
+        scroll(base_buffer, dx, dy);
+        damage->moved = true;
+        for (size_t i=0; i<damage->count; i++) {
+            damage->items[i].x += dx;
+            damage->items[i].y += dy;
+            damage->items[i] = rectangle_intersect(damage->items[i], screen);
+        }
+        old.preview.x += dx;
+        old.preview.y += dy;
+
+        Rectangle column = {
+            .x = dx > 0 ? 0 : screen.width + dx, .y = 0,
+            .width = ABS(dx), .height = screen.height,
+        };
+        Rectangle row = {
+            .x = MAX(0, dx), .y = dy > 0 ? 0 : screen.height + dy,
+            .width = screen.width - ABS(dx), .height = ABS(dy),
+        };
+        damage_add(damage, column, true);
+        damage_add(damage, row, true);
+    }
+
+    // the blocks that were truncated are covered by replaced
+    size_t last = MIN(MAX(old.cursor, new.cursor)/2, ctx->grid.count);
+    for (size_t i=MIN(old.cursor, new.cursor)/2; i<last; i++) {
+        damage_add(damage, block_rectangle(ctx, map, i), true);
+    }
+    if (old.generation != new.generation && replaced.x0 < replaced.x1) {
+        damage_add(damage, texel_to_screen(map, replaced), true);
+    }
+
+    if (old.has_preview != new.has_preview || !rectangle_equal(old.preview, new.preview)) {
+        if (old.has_preview) damage_add(damage, old.preview, false);
+        if (new.has_preview) damage_add(damage, new.preview, false);
+    }
+}
+
+// NOTE: the framebuffer follows the size of the window instead of the monitor it started on.
+// It grows in steps of FRAMEBUFFER_STEP so that dragging the border of the window does not
+// reallocate on every event and only shrinks once it holds more than four times the pixels needed.
+// Returns true when the buffers were replaced, their contents are lost then.
+bool framebuffer_fit(Rectangle screen) {
+    int width  = (MAX((int) screen.width,  1) + FRAMEBUFFER_STEP - 1) / FRAMEBUFFER_STEP * FRAMEBUFFER_STEP;
+    int height = (MAX((int) screen.height, 1) + FRAMEBUFFER_STEP - 1) / FRAMEBUFFER_STEP * FRAMEBUFFER_STEP;
+    bool fits = width <= framebuffer_width && height <= framebuffer_height;
+    bool wasteful = (size_t) framebuffer_width * framebuffer_height > 4 * (size_t) width * height;
+    if (fits && !wasteful) return false;
+
+    if (surface != NULL) RGFW_surface_free(surface);
+    free(pixel_buffer);
+    free(base_buffer);
+    pixel_buffer = malloc((size_t) width * height * 4);
+    base_buffer  = malloc((size_t) width * height * 4);
+    if (pixel_buffer == NULL || base_buffer == NULL) {
+        printf("[ERROR] could not allocate a framebuffer of %dx%d pixels\n", width, height);
+        exit(1);
+    }
+    pixel_stride = width;
+    framebuffer_width  = width;
+    framebuffer_height = height;
+    surface = RGFW_createSurface(pixel_buffer, width, height, pixel_format);
+    return true;
+}
+
+void framebuffer_free(void) {
+    if (surface != NULL) RGFW_surface_free(surface);
+    free(pixel_buffer);
+    free(base_buffer);
+    surface = NULL;
+    pixel_buffer = base_buffer = NULL;
+    framebuffer_width = framebuffer_height = 0;
+}
+
+// repaint and blit everything that was recorded in damage
+void render(Draw_Context *ctx, Damage *damage) {
+    Rectangle screen = window_rectangle();
+    if (damage->full) {
+        damage->count = 1;
+        damage->items[0] = screen;
+        damage->base[0]  = true;
+    }
+    for (size_t i=0; i<damage->count; i++) {
+        Rectangle r = damage->items[i];
+        draw(ctx, r, damage->base[i]);
+        if (!damage->full && !damage->moved) {
+            blit_surface_rectangle(win, surface, r.x, r.y, r.width, r.height);
+        }
+    }
+    if (damage->full || damage->moved) {
+        blit_surface_rectangle(win, surface, 0, 0, screen.width, screen.height);
+    }
+    damage->count = 0;
+    damage->full  = false;
+    damage->moved = false;
+}
+
+void undo(Draw_Context *ctx) {
     if (ctx->stack.cursor > 0) {
         ctx->stack.cursor--;
+        ctx->generation++;
+    }
+}
+
+void redo(Draw_Context *ctx) {
+    if (ctx->stack.cursor < ctx->stack.count) {
+        ctx->stack.cursor++;
+        ctx->generation++;
+    }
+}
+
+void replaced_add(Draw_Context *ctx, Texel_Rectangle t) {
+    Texel_Rectangle *r = &ctx->replaced;
+    if (t.x0 >= t.x1 || t.y0 >= t.y1) return;
+    if (r->x0 >= r->x1) {
+        *r = t;
+        return;
+    }
+    r->x0 = MIN(r->x0, t.x0);
+    r->y0 = MIN(r->y0, t.y0);
+    r->x1 = MAX(r->x1, t.x1);
+    r->y1 = MAX(r->y1, t.y1);
+}
+
+void click(Draw_Context *ctx) {
+    Vector2 mouse_screen = get_mouse_position();
+    Vector2 mouse_tex    = screen_to_texel(view_mapping(ctx), mouse_screen);
+
+    if (in_rectangle(mouse_tex, image_rectangle(ctx))) {
+        // the undone blocks after the cursor are overwritten, they may still be on the screen
+        bool overwrites = ctx->grid.count > ctx->stack.cursor/2;
+        for (size_t i=ctx->stack.cursor/2; i<ctx->grid.count; i++) replaced_add(ctx, block_texels(ctx, i));
+        block_grid_truncate(&ctx->grid, ctx->stack.cursor/2);
+        push_point(&ctx->stack, mouse_tex);
+        ctx->generation++;
+        if (ctx->stack.cursor % 2 == 0) {
+            size_t i = ctx->stack.cursor/2 - 1;
+            block_grid_insert(&ctx->grid, ctx->width, ctx->height, texel_rectangle(ctx, ctx->stack.items[2*i+0], ctx->stack.items[2*i+1]));
+            if (overwrites || ctx->replaced.x0 < ctx->replaced.x1) replaced_add(ctx, block_texels(ctx, i));
+        }
+    }
+}
+
+// move the view by the given number of pan steps, every step moves the content by whole pixels
+void pan(Draw_Context *ctx, int steps_x, int steps_y) {
+    Rectangle screen = window_rectangle();
+    ctx->center.x += steps_x * roundf(PAN_STEP * screen.width)  / ctx->scale;
+    ctx->center.y += steps_y * roundf(PAN_STEP * screen.height) / ctx->scale;
+}
+
+// center and rescale the image view such that it fits in the window and is as big as possible
+void fit(Draw_Context *ctx) {
+    Vector2 half = {.x = 0.5, .y = 0.5};
+    ctx->center = rectangle_transform(half, image_rectangle(ctx));
+    Rectangle screen = window_rectangle();
+    float ws = screen.width / ctx->width;
+    float hs = screen.height / ctx->height;
+    ctx->scale = fminf(ws, hs);
+}
+
+void byte_da_append(Byte_DA *da, uint8_t byte) {
+    if (da->count == da->capacity) {
+        da->capacity = da->capacity == 0 ? 1024 : 2*da->capacity;
+        da->items = realloc(da->items, da->capacity);
+        assert(da->items != NULL);
+    }
+    da->items[da->count++] = byte;
+}
+
+void bits_add(Bit_Writer *w, uint32_t value, int count) {
+    w->bits |= value << w->bit_count;
+    w->bit_count += count;
+    while (w->bit_count >= 8) {
+        byte_da_append(&w->bytes, w->bits & 0xFF);
+        w->bits >>= 8;
+        w->bit_count -= 8;
+    }
+}
+
+// pad with zeros to the next byte boundary
+void bits_flush(Bit_Writer *w) {
+    if (w->bit_count > 0) bits_add(w, 0, 8 - w->bit_count);
+}
+
+// huffman codes are written starting at their most significant bit
+uint32_t bit_reverse(uint32_t code, int length) {
+    uint32_t result = 0;
+    for (int i=0; i<length; i++) {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return result;
+}
+
+// a symbol of the fixed huffman literal/length alphabet
+void deflate_symbol(Bit_Writer *w, int symbol) {
+    if (symbol < 144) {
+        bits_add(w, bit_reverse(0x30 + symbol, 8), 8);
+    } else if (symbol < 256) {
+        bits_add(w, bit_reverse(0x190 + symbol - 144, 9), 9);
+    } else if (symbol < 280) {
+        bits_add(w, bit_reverse(symbol - 256, 7), 7);
+    } else {
+        bits_add(w, bit_reverse(0xC0 + symbol - 280, 8), 8);
+    }
+}
+
+void deflate_match(Bit_Writer *w, int length, int distance) {
+    static const uint16_t length_base[]    = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+    static const uint8_t  length_extra[]   = { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+    static const uint16_t distance_base[]  = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+    static const uint8_t  distance_extra[] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+    int l = 28;
+    while (length_base[l] > length) l--;
+    deflate_symbol(w, 257 + l);
+    if (length_extra[l]) bits_add(w, length - length_base[l], length_extra[l]);
+    int d = 29;
+    while (distance_base[d] > distance) d--;
+    bits_add(w, bit_reverse(d, 5), 5);
+    if (distance_extra[d]) bits_add(w, distance - distance_base[d], distance_extra[d]);
+}
+
+uint32_t deflate_hash(uint8_t *p) {
+    uint32_t v = p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16;
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// the longest match for data[i, size) among the last max_chain positions with the same hash
+int deflate_longest(uint8_t *data, int32_t *head, int32_t *prev, int32_t i, int32_t size, int max_chain, int *distance) {
+    int best = 0;
+    int limit = MIN(258, size - i);
+    int32_t p = head[deflate_hash(&data[i])];
+    for (int chain=0; p >= 0 && chain < max_chain && i - p <= DEFLATE_WINDOW; chain++, p = prev[p]) {
+        int length = 0;
+        while (length < limit && data[p + length] == data[i + length]) length++;
+        if (length > best) {
+            best = length;
+            *distance = i - p;
+            if (length == limit) break;
+        }
+    }
+    return best;
+}
+
+// NOTE: compresses data[start, size) like stbi_zlib_compress does (fixed huffman codes, hash chains
+// with lazy matching), but matches may reach back into data[0, start) and unless the chunk is the
+// last one the block is followed by an empty stored block. That sync flush ends the chunk on a byte
+// boundary, so the chunks of a stream can be compressed independently and simply concatenated.
+void deflate_chunk(Bit_Writer *w, uint8_t *data, int32_t start, int32_t size, bool last, int max_chain) {
+    int32_t *head = malloc(sizeof(*head) << DEFLATE_HASH_BITS);
+    int32_t *prev = malloc(sizeof(*prev) * MAX(size, 1));
+    assert(head != NULL && prev != NULL);
+    memset(head, 0xFF, sizeof(*head) << DEFLATE_HASH_BITS);
+
+    bits_add(w, last, 1); // BFINAL
+    bits_add(w, 1, 2);    // BTYPE = fixed huffman
+    for (int32_t i=0; i<start && i+3 <= size; i++) {
+        uint32_t h = deflate_hash(&data[i]);
+        prev[i] = head[h];
+        head[h] = i;
+    }
+    int32_t i = start;
+    while (i < size) {
+        int distance = 0, length = 0;
+        if (i+3 <= size) {
+            length = deflate_longest(data, head, prev, i, size, max_chain, &distance);
+            uint32_t h = deflate_hash(&data[i]);
+            prev[i] = head[h];
+            head[h] = i;
+            // a longer match at the next byte is worth a literal
+            int next_distance;
+            if (length >= 3 && i+4 <= size && deflate_longest(data, head, prev, i+1, size, max_chain, &next_distance) > length) {
+                length = 0;
+            }
+        }
+        if (length >= 3) {
+            deflate_match(w, length, distance);
+            i += length;
+        } else {
+            deflate_symbol(w, data[i]);
+            i++;
+        }
+    }
+    deflate_symbol(w, 256); // end of block
+    free(head);
+    free(prev);
+
+    // stored blocks are cheaper when the data does not compress
+    size_t stored_size = (size - start) + 5*((size - start)/65535 + 1);
+    if (w->bytes.count > stored_size) {
+        w->bytes.count = 0;
+        w->bits = 0;
+        w->bit_count = 0;
+        for (int32_t j=start; j<size; j+=65535) {
+            int32_t length = MIN(65535, size - j);
+            bits_add(w, last && j+length == size, 1);
+            bits_add(w, 0, 2);
+            bits_flush(w);
+            bits_add(w, length, 16);
+            bits_add(w, length ^ 0xFFFF, 16);
+            for (int32_t k=0; k<length; k++) byte_da_append(&w->bytes, data[j+k]);
+        }
+        // stored blocks end on a byte boundary already
+        return;
+    }
+    if (!last) {
+        bits_add(w, 0, 3);
+        bits_flush(w);
+        bits_add(w, 0x0000, 16);
+        bits_add(w, 0xFFFF, 16);
+    }
+    bits_flush(w);
+}
+
+uint32_t adler32(uint8_t *data, size_t size) {
+    uint32_t s1 = 1, s2 = 0;
+    while (size > 0) {
+        size_t n = MIN(size, 5552); // the largest n where the sums can not overflow
+        for (size_t i=0; i<n; i++) {
+            s1 += data[i];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+        data += n;
+        size -= n;
+    }
+    return s2 << 16 | s1;
+}
+
+// the adler32 of the concatenation of two parts, b of them of size b_size
+uint32_t adler32_combine(uint32_t a, uint32_t b, size_t b_size) {
+    uint64_t rem = b_size % 65521;
+    uint64_t s1 = ((a & 0xFFFF) + (b & 0xFFFF) + 65521 - 1) % 65521;
+    uint64_t s2 = (rem * (a & 0xFFFF) + (a >> 16) + (b >> 16) + 65521 - rem) % 65521;
+    return s2 << 16 | s1;
+}
+
+uint32_t crc_table[256];
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size) {
+    for (size_t i=0; i<size; i++) crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+// the CRC of a PNG chunk covers its type and its data
+uint32_t png_crc(const char *type, const uint8_t *data, size_t size) {
+    if (crc_table[1] == 0) {
+        for (uint32_t n=0; n<256; n++) {
+            uint32_t c = n;
+            for (int k=0; k<8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            crc_table[n] = c;
+        }
+    }
+    uint32_t crc = crc32_update(0xFFFFFFFF, (const uint8_t*) type, 4);
+    return crc32_update(crc, data, size) ^ 0xFFFFFFFF;
+}
+
+void put_u32_be(uint8_t *out, uint32_t v) {
+    out[0] = v >> 24;
+    out[1] = v >> 16;
+    out[2] = v >> 8;
+    out[3] = v;
+}
+
+// NOTE: the encoders hand their output to a File_Writer as soon as it is ready, so an export
+// never holds the whole encoded file, only EXPORT_BUFFER_SIZE bytes of it
+typedef struct {
+    FILE *file;
+    uint8_t *buffer;
+    size_t count;
+    bool ok; // false once anything could not be written
+} File_Writer;
+
+bool file_writer_open(File_Writer *w, const char *path) {
+    w->file = fopen(path, "wb");
+    w->buffer = malloc(EXPORT_BUFFER_SIZE);
+    assert(w->buffer != NULL);
+    w->count = 0;
+    w->ok = w->file != NULL;
+    return w->ok;
+}
+
+void file_writer_flush(File_Writer *w) {
+    if (w->ok && w->count > 0) w->ok = fwrite(w->buffer, w->count, 1, w->file) == 1;
+    w->count = 0;
+}
+
+void file_write(File_Writer *w, const void *data, size_t size) {
+    if (size == 0) return;
+    if (w->count + size > EXPORT_BUFFER_SIZE) {
+        file_writer_flush(w);
+        if (size >= EXPORT_BUFFER_SIZE) {
+            if (w->ok) w->ok = fwrite(data, size, 1, w->file) == 1;
+            return;
+        }
+    }
+    memcpy(&w->buffer[w->count], data, size);
+    w->count += size;
+}
+
+// returns false when anything could not be written
+bool file_writer_close(File_Writer *w) {
+    file_writer_flush(w);
+    if (w->file != NULL && fclose(w->file) != 0) w->ok = false;
+    free(w->buffer);
+    return w->ok;
+}
+
+void png_write_chunk(File_Writer *out, const char *type, const uint8_t *data, size_t size, uint32_t crc) {
+    uint8_t length[4], checksum[4];
+    put_u32_be(length, size);
+    put_u32_be(checksum, crc);
+    file_write(out, length, 4);
+    file_write(out, type, 4);
+    file_write(out, data, size);
+    file_write(out, checksum, 4);
+}
+
+typedef struct {
+    File_Writer *out;
+    int width, height, channels;
+    size_t row_size;       // of a filtered row
+    int rows_per_chunk;
+    int band_rows;         // rows that are pushed at once, one chunk per thread of export_pool
+    int y;                 // first row of the band
+    int count;             // rows in the band
+    uint8_t *pixels;       // of the band
+    uint8_t *above;        // the last row of the previous band
+    uint8_t *filtered;     // the window of the deflate stream, then the filtered rows of the band
+    size_t history;        // bytes of the window, at most DEFLATE_WINDOW
+    size_t chunk_count;    // in the band
+    Bit_Writer *chunks;
+    uint32_t *adlers;
+    uint32_t *crcs;
+    uint32_t adler;        // of everything filtered so far
+    int max_chain;
+} Png_Encoder;
+
+uint8_t png_filter_byte(int type, uint8_t x, uint8_t a, uint8_t b, uint8_t c) {
+    switch (type) {
+        case 1: return x - a;
+        case 2: return x - b;
+        case 3: return x - ((a + b) >> 1);
+        case 4: {
+            int p = a + b - c;
+            int pa = ABS(p - a), pb = ABS(p - b), pc = ABS(p - c);
+            return x - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+        }
+        default: return x;
+    }
+}
+
+// filter the rows of a chunk with the filter that gives the smallest sum of absolute values,
+// the heuristic stbi_write_png uses as well
+void png_filter_task(void *arg, size_t index) {
+    Png_Encoder *job = arg;
+    int n = job->channels;
+    size_t line = (size_t) job->width * n;
+    int y0 = index * job->rows_per_chunk;
+    int y1 = MIN(job->count, y0 + job->rows_per_chunk);
+    for (int y=y0; y<y1; y++) {
+        uint8_t *row   = &job->pixels[y * line];
+        uint8_t *above = y > 0 ? row - line : job->y > 0 ? job->above : NULL;
+        int best_type = 0;
+        size_t best_sum = SIZE_MAX;
+        for (int type=0; type<5; type++) {
+            size_t sum = 0;
+            for (size_t i=0; i<line; i++) {
+                uint8_t a = i >= (size_t) n ? row[i-n] : 0;
+                uint8_t b = above ? above[i] : 0;
+                uint8_t c = above && i >= (size_t) n ? above[i-n] : 0;
+                sum += ABS((int8_t) png_filter_byte(type, row[i], a, b, c));
+            }
+            if (sum < best_sum) {
+                best_sum = sum;
+                best_type = type;
+            }
+        }
+        uint8_t *out = &job->filtered[job->history + y * job->row_size];
+        out[0] = best_type;
+        for (size_t i=0; i<line; i++) {
+            uint8_t a = i >= (size_t) n ? row[i-n] : 0;
+            uint8_t b = above ? above[i] : 0;
+            uint8_t c = above && i >= (size_t) n ? above[i-n] : 0;
+            out[i+1] = png_filter_byte(best_type, row[i], a, b, c);
+        }
+    }
+}
+
+void png_deflate_task(void *arg, size_t index) {
+    Png_Encoder *job = arg;
+    size_t start = job->history + index * job->rows_per_chunk * job->row_size;
+    size_t end = job->history + MIN((size_t) job->count, (index + 1) * job->rows_per_chunk) * job->row_size;
+    size_t window = MIN(start, DEFLATE_WINDOW);
+    bool last = job->y + job->count == job->height && index == job->chunk_count-1;
+    Bit_Writer *w = &job->chunks[index];
+    w->bytes.count = 0;
+    deflate_chunk(w, &job->filtered[start - window], window, window + (end - start), last, job->max_chain);
+    job->adlers[index] = adler32(&job->filtered[start], end - start);
+    job->crcs[index] = png_crc("IDAT", w->bytes.items, w->bytes.count);
+}
+
+// NOTE: stbi_write_png filters and compresses the whole image on one thread. This splits the
+// rows into chunks of about PNG_CHUNK_SIZE bytes that are filtered and then compressed on
+// export_pool, pigz style, and writes every chunk as an IDAT chunk of its own. The rows are pushed
+// in bands of band_rows, only the band and the deflate window of the rows before it are kept.
+void png_encoder_open(Png_Encoder *job, File_Writer *out, int width, int height, int channels) {
+    static const uint8_t color_types[] = { 0, 0, 4, 2, 6 }; // by channel count
+    assert(1 <= channels && channels <= 4);
+    *job = (Png_Encoder) {
+        .out = out,
+        .width = width,
+        .height = height,
+        .channels = channels,
+        .row_size = (size_t) width * channels + 1,
+        .adler = 1,
+        .max_chain = 2 * MAX(stbi_write_png_compression_level, 5),
+    };
+    size_t threads = MAX(export_pool.thread_count, 1);
+    job->rows_per_chunk = MAX(1, PNG_CHUNK_SIZE / job->row_size);
+    job->band_rows = job->rows_per_chunk * threads;
+    job->above    = malloc((size_t) width * channels);
+    job->filtered = malloc(DEFLATE_WINDOW + job->row_size * job->band_rows);
+    job->chunks = calloc(threads, sizeof(*job->chunks));
+    job->adlers = malloc(sizeof(*job->adlers) * threads);
+    job->crcs   = malloc(sizeof(*job->crcs) * threads);
+    assert(job->above != NULL && job->filtered != NULL && job->chunks != NULL && job->adlers != NULL && job->crcs != NULL);
+    png_crc("IEND", NULL, 0); // builds the table before the threads use it
+
+    static const uint8_t signature[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    uint8_t header[13];
+    put_u32_be(&header[0], width);
+    put_u32_be(&header[4], height);
+    header[8]  = 8; // bit depth
+    header[9]  = color_types[channels];
+    header[10] = 0; // compression
+    header[11] = 0; // filter
+    header[12] = 0; // interlace
+    static const uint8_t zlib_header[] = { 0x78, 0x5E }; // 32K window, FLEVEL = 1
+    file_write(out, signature, sizeof(signature));
+    png_write_chunk(out, "IHDR", header, sizeof(header), png_crc("IHDR", header, sizeof(header)));
+    png_write_chunk(out, "IDAT", zlib_header, sizeof(zlib_header), png_crc("IDAT", zlib_header, sizeof(zlib_header)));
+}
+
+// the next count rows, at most band_rows
+void png_encoder_push(Png_Encoder *job, uint8_t *pixels, int count) {
+    assert(0 < count && count <= job->band_rows && job->y + count <= job->height);
+    job->pixels = pixels;
+    job->count = count;
+    job->chunk_count = (count + job->rows_per_chunk - 1) / job->rows_per_chunk;
+    pool_run(&export_pool, png_filter_task, job, job->chunk_count);
+    pool_run(&export_pool, png_deflate_task, job, job->chunk_count);
+
+    for (size_t k=0; k<job->chunk_count; k++) {
+        size_t rows = MIN(job->rows_per_chunk, count - (int) k * job->rows_per_chunk);
+        job->adler = adler32_combine(job->adler, job->adlers[k], rows * job->row_size);
+        png_write_chunk(job->out, "IDAT", job->chunks[k].bytes.items, job->chunks[k].bytes.count, job->crcs[k]);
+    }
+
+    // the end of the band is the window of the next one
+    size_t line = (size_t) job->width * job->channels;
+    size_t size = job->history + count * job->row_size;
+    size_t keep = MIN(size, DEFLATE_WINDOW);
+    memmove(job->filtered, &job->filtered[size - keep], keep);
+    job->history = keep;
+    memcpy(job->above, &pixels[(count - 1) * line], line);
+    job->y += count;
+}
+
+void png_encoder_close(Png_Encoder *job) {
+    assert(job->y == job->height);
+    uint8_t zlib_trailer[4];
+    put_u32_be(zlib_trailer, job->adler);
+    png_write_chunk(job->out, "IDAT", zlib_trailer, sizeof(zlib_trailer), png_crc("IDAT", zlib_trailer, sizeof(zlib_trailer)));
+    png_write_chunk(job->out, "IEND", NULL, 0, png_crc("IEND", NULL, 0));
+
+    for (size_t k=0; k<(size_t) job->band_rows / job->rows_per_chunk; k++) free(job->chunks[k].bytes.items);
+    free(job->chunks);
+    free(job->adlers);
+    free(job->crcs);
+    free(job->filtered);
+    free(job->above);
+}
+
+// JPEG redaction
+//
+// NOTE: a baseline JPEG can be redacted without going through pixels at all. Its entropy coded
+// data is decoded to the quantized DCT coefficients and every MCU that intersects a block is
+// replaced by the flat block color (a DC coefficient only). All other MCUs are copied bit for bit,
+// only the one after a flat MCU is encoded again because its DC difference changes. With restart
+// markers the intervals without blocks are copied without decoding them at all. If the huffman
+// tables of the file lack a symbol for the flat MCUs everything is encoded again with tables that
+// are optimal for the result. Progressive, arithmetic coded, multi scan and CMYK files are not
+// handled, export encodes their pixels instead.
+
+typedef struct {
+    uint8_t lengths[17]; // lengths[l] is the number of codes of length l
+    uint8_t values[256]; // sorted by code
+    // decoding
+    int32_t max_code[18];     // largest code of each length, -1 if there is none
+    int32_t value_offset[17]; // values index of a code minus the code
+    uint16_t lookup[1 << JPEG_LOOKUP_BITS]; // size << 8 | value for codes up to JPEG_LOOKUP_BITS long, 0 otherwise
+    // encoding
+    uint16_t codes[256];
+    uint8_t sizes[256];
+} Huffman_Table;
+
+typedef struct {
+    int id;
+    int h, v;       // sampling factors
+    int quant;      // quantization table
+    int dc, ac;     // huffman tables of the scan
+    int prediction; // DC of the last block that was decoded
+    int written;    // DC of the last block that was written
+} Jpeg_Component;
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    int width, height;
+    Jpeg_Component components[3];
+    int component_count;
+    int h_max, v_max;
+    uint16_t quant[4][64];
+    Huffman_Table dc[4], ac[4];         // as they are read
+    Huffman_Table dc_out[4], ac_out[4]; // as they are written
+    bool dc_defined[4], ac_defined[4];
+    int restart_interval;
+    Byte_DA header;       // the segments up to the scan that are written again
+    size_t scan_header;   // the SOS segment
+    size_t scan_data;     // first byte of the entropy coded data
+} Jpeg;
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t pos;
+    uint32_t bits;
+    int count;
+    size_t consumed; // number of bits taken so far
+} Jpeg_Reader;
+
+// writes bits starting at the most significant bit of each byte and stuffs a zero after 0xFF
+typedef struct {
+    Byte_DA bytes;
+    uint64_t bits;
+    int count;
+} Jpeg_Writer;
+
+uint16_t read_u16_be(uint8_t *p) {
+    return p[0] << 8 | p[1];
+}
+
+// position of the next marker at or after pos, size if there is none
+size_t jpeg_next_marker(uint8_t *data, size_t size, size_t pos) {
+    while (pos+1 < size && !(data[pos] == 0xFF && data[pos+1] != 0x00 && data[pos+1] != 0xFF)) pos++;
+    return pos+1 < size ? pos : size;
+}
+
+void huffman_decoding(Huffman_Table *t) {
+    int32_t code = 0;
+    int k = 0;
+    memset(t->lookup, 0, sizeof(t->lookup));
+    for (int l=1; l<=16; l++) {
+        t->value_offset[l] = k - code;
+        for (int i=0; i<t->lengths[l]; i++, k++, code++) {
+            if (l <= JPEG_LOOKUP_BITS && code < (1 << l)) {
+                int shift = JPEG_LOOKUP_BITS - l;
+                for (int j=0; j < 1 << shift; j++) t->lookup[code << shift | j] = l << 8 | t->values[k];
+            }
+        }
+        t->max_code[l] = t->lengths[l] > 0 ? code - 1 : -1;
+        code <<= 1;
+    }
+    t->max_code[17] = INT32_MAX;
+}
+
+void huffman_encoding(Huffman_Table *t) {
+    int code = 0, k = 0;
+    memset(t->sizes, 0, sizeof(t->sizes));
+    for (int l=1; l<=16; l++) {
+        for (int i=0; i<t->lengths[l]; i++, k++, code++) {
+            t->codes[t->values[k]] = code;
+            t->sizes[t->values[k]] = l;
+        }
+        code <<= 1;
+    }
+}
+
+// the code lengths of an optimal huffman code for freq that are at most 16 bits long and
+// leave out the code of all ones, as in section K.2 of the JPEG standard
+void huffman_optimal(Huffman_Table *t, const long *frequencies) {
+    long freq[257];
+    int code_size[257] = {0};
+    int others[257];
+    memcpy(freq, frequencies, sizeof(*freq) * 256);
+    freq[256] = 1; // reserves the code of all ones
+    for (int i=0; i<257; i++) others[i] = -1;
+    for (;;) {
+        int c1 = -1, c2 = -1;
+        for (int i=0; i<257; i++) {
+            if (freq[i] > 0 && (c1 < 0 || freq[i] <= freq[c1])) c1 = i;
+        }
+        for (int i=0; i<257; i++) {
+            if (freq[i] > 0 && i != c1 && (c2 < 0 || freq[i] <= freq[c2])) c2 = i;
+        }
+        if (c2 < 0) break;
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        code_size[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            code_size[c1]++;
+        }
+        others[c1] = c2;
+        code_size[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            code_size[c2]++;
+        }
+    }
+    int bits[33] = {0};
+    for (int i=0; i<257; i++) if (code_size[i] > 0) bits[MIN(code_size[i], 32)]++;
+    for (int i=32; i>16; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) j--;
+            bits[i] -= 2;
+            bits[i-1]++;
+            bits[j+1] += 2;
+            bits[j]--;
+        }
+    }
+    int longest = 16;
+    while (bits[longest] == 0) longest--;
+    bits[longest]--;
+
+    memset(t->lengths, 0, sizeof(t->lengths));
+    for (int l=1; l<=16; l++) t->lengths[l] = bits[l];
+    int k = 0;
+    for (int size=1; size<=32; size++) {
+        for (int i=0; i<256; i++) if (code_size[i] == size) t->values[k++] = i;
+    }
+}
+
+// parses the file up to the entropy coded data, returns false if it is not supported
+bool jpeg_parse(Jpeg *jpeg) {
+    uint8_t *d = jpeg->data;
+    if (jpeg->size < 4 || d[0] != 0xFF || d[1] != 0xD8) return false;
+    byte_da_append(&jpeg->header, 0xFF);
+    byte_da_append(&jpeg->header, 0xD8);
+    size_t pos = 2;
+    bool frame = false, adobe_rgb = false;
+    for (;;) {
+        while (pos < jpeg->size && d[pos] == 0xFF && pos+1 < jpeg->size && d[pos+1] == 0xFF) pos++;
+        if (pos+4 > jpeg->size || d[pos] != 0xFF) return false;
+        uint8_t marker = d[pos+1];
+        size_t length = read_u16_be(&d[pos+2]);
+        if (length < 2 || pos + 2 + length > jpeg->size) return false;
+        uint8_t *s = &d[pos+4];
+        size_t size = length - 2;
+        size_t end = pos + 2 + length;
+        bool keep = true;
+
+        if (marker == 0xC0 || marker == 0xC1) {
+            if (size < 6 || s[0] != 8) return false;
+            jpeg->height = read_u16_be(&s[1]);
+            jpeg->width  = read_u16_be(&s[3]);
+            jpeg->component_count = s[5];
+            if (jpeg->width == 0 || jpeg->height == 0) return false;
+            if (jpeg->component_count != 1 && jpeg->component_count != 3) return false;
+            if (size < 6 + 3 * (size_t) jpeg->component_count) return false;
+            for (int i=0; i<jpeg->component_count; i++) {
+                Jpeg_Component *c = &jpeg->components[i];
+                c->id = s[6 + 3*i];
+                c->h = s[7 + 3*i] >> 4;
+                c->v = s[7 + 3*i] & 15;
+                c->quant = s[8 + 3*i];
+                if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4 || c->quant > 3) return false;
+                jpeg->h_max = MAX(jpeg->h_max, c->h);
+                jpeg->v_max = MAX(jpeg->v_max, c->v);
+            }
+            frame = true;
+        } else if ((marker & 0xF0) == 0xC0 && marker != 0xC4) {
+            return false; // progressive, lossless or arithmetic coded
+        } else if (marker == 0xC4) {
+            for (size_t i=0; i<size;) {
+                if (i + 17 > size) return false;
+                int class = s[i] >> 4, id = s[i] & 15;
+                if (class > 1 || id > 3) return false;
+                Huffman_Table *t = class == 0 ? &jpeg->dc[id] : &jpeg->ac[id];
+                int count = 0;
+                t->lengths[0] = 0;
+                for (int l=1; l<=16; l++) {
+                    t->lengths[l] = s[i+l];
+                    count += s[i+l];
+                }
+                if (count > 256 || i + 17 + count > size) return false;
+                memcpy(t->values, &s[i+17], count);
+                huffman_decoding(t);
+                if (class == 0) jpeg->dc_defined[id] = true; else jpeg->ac_defined[id] = true;
+                i += 17 + count;
+            }
+        } else if (marker == 0xDB) {
+            for (size_t i=0; i<size;) {
+                int precision = s[i] >> 4, id = s[i] & 15;
+                if (precision > 1 || id > 3 || i + 1 + 64*(precision+1) > size) return false;
+                for (int k=0; k<64; k++) {
+                    jpeg->quant[id][k] = precision == 0 ? s[i+1+k] : read_u16_be(&s[i+1+2*k]);
+                }
+                i += 1 + 64*(precision+1);
+            }
+        } else if (marker == 0xDD) {
+            if (size < 2) return false;
+            jpeg->restart_interval = read_u16_be(s);
+        } else if (marker == 0xEE) {
+            // an Adobe segment with transform 0 means the components are RGB
+            if (size >= 12 && memcmp(s, "Adobe", 5) == 0 && s[11] == 0) adobe_rgb = true;
+        } else if (marker == 0xDA) {
+            if (!frame || size < 1) return false;
+            int count = s[0];
+            if (count != jpeg->component_count || size < 4 + 2 * (size_t) count) return false;
+            for (int i=0; i<count; i++) {
+                Jpeg_Component *c = &jpeg->components[i];
+                if (s[1 + 2*i] != c->id) return false;
+                c->dc = s[2 + 2*i] >> 4;
+                c->ac = s[2 + 2*i] & 15;
+                if (c->dc > 3 || c->ac > 3 || !jpeg->dc_defined[c->dc] || !jpeg->ac_defined[c->ac]) return false;
+            }
+            // only sequential scans over all coefficients
+            if (s[1 + 2*count] != 0 || s[2 + 2*count] != 63 || s[3 + 2*count] != 0) return false;
+            if (adobe_rgb && jpeg->component_count == 3) return false;
+            jpeg->scan_header = pos;
+            jpeg->scan_data = end;
+            return true;
+        } else if (marker == 0xD8 || marker == 0xD9 || (0xD0 <= marker && marker <= 0xD7)) {
+            return false;
+        } else if (marker >= 0xE0) {
+            // NOTE: metadata like EXIF may hold a thumbnail of the unredacted image, only the
+            // segments about how to interpret the image are kept (JFIF, ICC profile and Adobe)
+            keep = marker == 0xE0 || marker == 0xE2 || marker == 0xEE;
+        } else if (marker == 0xFE) {
+            keep = false; // comment
+        }
+        if (keep) {
+            for (size_t i=pos; i<end; i++) byte_da_append(&jpeg->header, d[i]);
+        }
+        pos = end;
+    }
+}
+
+void jpeg_reader_fill(Jpeg_Reader *r) {
+    while (r->count <= 24) {
+        uint8_t byte = 0;
+        if (r->pos < r->size) {
+            byte = r->data[r->pos];
+            if (byte == 0xFF) {
+                uint8_t next = r->pos+1 < r->size ? r->data[r->pos+1] : 0xD9;
+                if (next == 0x00) {
+                    r->pos += 2;
+                } else {
+                    byte = 0; // a marker ends the data, zeros are read after it
+                }
+            } else {
+                r->pos++;
+            }
+        }
+        r->bits |= (uint32_t) byte << (24 - r->count);
+        r->count += 8;
+    }
+}
+
+uint32_t jpeg_read_bits(Jpeg_Reader *r, int n) {
+    if (n == 0) return 0;
+    jpeg_reader_fill(r);
+    uint32_t result = r->bits >> (32 - n);
+    r->bits <<= n;
+    r->count -= n;
+    r->consumed += n;
+    return result;
+}
+
+// returns -1 for an invalid code
+int jpeg_decode_symbol(Jpeg_Reader *r, Huffman_Table *t) {
+    jpeg_reader_fill(r);
+    uint16_t entry = t->lookup[r->bits >> (32 - JPEG_LOOKUP_BITS)];
+    if (entry != 0) {
+        r->bits <<= entry >> 8;
+        r->count -= entry >> 8;
+        r->consumed += entry >> 8;
+        return entry & 0xFF;
+    }
+    int32_t code = r->bits >> (32 - JPEG_LOOKUP_BITS);
+    int l = JPEG_LOOKUP_BITS;
+    while (code > t->max_code[l]) {
+        code = code << 1 | ((r->bits >> (31 - l)) & 1);
+        l++;
+    }
+    if (l > 16) return -1;
+    r->bits <<= l;
+    r->count -= l;
+    r->consumed += l;
+    return t->values[t->value_offset[l] + code];
+}
+
+// the value of the size bits that follow a symbol
+int jpeg_extend(uint32_t bits, int size) {
+    return size == 0 ? 0 : bits < (1u << (size-1)) ? (int) bits - (1 << size) + 1 : (int) bits;
+}
+
+// reads the quantized coefficients of a block in zigzag order
+bool jpeg_decode_block(Jpeg_Reader *r, Jpeg *jpeg, Jpeg_Component *c, int16_t *coefficients) {
+    memset(coefficients, 0, sizeof(*coefficients) * 64);
+    int size = jpeg_decode_symbol(r, &jpeg->dc[c->dc]);
+    if (size < 0 || size > 11) return false;
+    c->prediction += jpeg_extend(jpeg_read_bits(r, size), size);
+    coefficients[0] = c->prediction;
+    for (int k=1; k<64;) {
+        int symbol = jpeg_decode_symbol(r, &jpeg->ac[c->ac]);
+        if (symbol < 0) return false;
+        int run = symbol >> 4;
+        size = symbol & 15;
+        if (size == 0) {
+            if (run != 15) break;
+            k += 16;
+            continue;
+        }
+        k += run;
+        if (k > 63) return false;
+        coefficients[k++] = jpeg_extend(jpeg_read_bits(r, size), size);
+    }
+    return true;
+}
+
+// size may be up to 32
+void jpeg_write_bits(Jpeg_Writer *w, uint32_t value, int size) {
+    w->bits = (w->bits << size) | (value & ((1ull << size) - 1));
+    w->count += size;
+    while (w->count >= 8) {
+        uint8_t byte = w->bits >> (w->count - 8);
+        byte_da_append(&w->bytes, byte);
+        if (byte == 0xFF) byte_da_append(&w->bytes, 0x00);
+        w->count -= 8;
+    }
+    w->bits &= (1ull << w->count) - 1;
+}
+
+// pad with ones to the next byte boundary
+void jpeg_writer_flush(Jpeg_Writer *w) {
+    if (w->count > 0) jpeg_write_bits(w, 0x7F, 8 - w->count);
+}
+
+// writes the bits that r took since it was in the state of from
+void jpeg_copy_bits(Jpeg_Writer *w, Jpeg_Reader from, Jpeg_Reader *r) {
+    for (size_t n = r->consumed - from.consumed; n > 0;) {
+        int size = MIN(n, 16);
+        jpeg_write_bits(w, jpeg_read_bits(&from, size), size);
+        n -= size;
+    }
+}
+
+int jpeg_category(int value) {
+    int result = 0;
+    for (value = ABS(value); value > 0; value >>= 1) result++;
+    return result;
+}
+
+// with w == NULL only the frequencies of the symbols are counted, returns false if the tables
+// lack a symbol
+bool jpeg_encode_block(Jpeg_Writer *w, Jpeg *jpeg, Jpeg_Component *c, int16_t *coefficients, long (*frequencies)[2][256]) {
+    int diff = coefficients[0] - c->written;
+    c->written = coefficients[0];
+    int size = jpeg_category(diff);
+    if (w == NULL) {
+        frequencies[c->dc][0][size]++;
+    } else {
+        Huffman_Table *t = &jpeg->dc_out[c->dc];
+        if (t->sizes[size] == 0) return false;
+        // the code and the bits of the value at once
+        uint32_t bits = (diff < 0 ? diff - 1 : diff) & ((1u << size) - 1);
+        jpeg_write_bits(w, (uint32_t) t->codes[size] << size | bits, t->sizes[size] + size);
+    }
+    Huffman_Table *t = &jpeg->ac_out[c->ac];
+    // the zeros after the last nonzero coefficient are coded by the end of block symbol
+    int last = 63;
+    while (last > 0 && coefficients[last] == 0) last--;
+    int run = 0;
+    for (int k=1; k<=last; k++) {
+        if (coefficients[k] == 0) {
+            run++;
+            continue;
+        }
+        for (; run > 15; run -= 16) {
+            if (w == NULL) {
+                frequencies[c->ac][1][0xF0]++;
+            } else {
+                if (t->sizes[0xF0] == 0) return false;
+                jpeg_write_bits(w, t->codes[0xF0], t->sizes[0xF0]);
+            }
+        }
+        size = jpeg_category(coefficients[k]);
+        int symbol = run << 4 | size;
+        if (w == NULL) {
+            frequencies[c->ac][1][symbol]++;
+        } else {
+            if (t->sizes[symbol] == 0) return false;
+            uint32_t bits = (coefficients[k] < 0 ? coefficients[k] - 1 : coefficients[k]) & ((1u << size) - 1);
+            jpeg_write_bits(w, (uint32_t) t->codes[symbol] << size | bits, t->sizes[symbol] + size);
+        }
+        run = 0;
+    }
+    if (last < 63) {
+        if (w == NULL) {
+            frequencies[c->ac][1][0x00]++;
+        } else {
+            if (t->sizes[0x00] == 0) return false;
+            jpeg_write_bits(w, t->codes[0x00], t->sizes[0x00]);
+        }
     }
+    return true;
 }
 
-void redo(Draw_Context *ctx) {
-    if (ctx->stack.cursor < ctx->stack.count) {
-        ctx->stack.cursor++;
+// decodes the scan and encodes it again with the MCUs in flat replaced by the DC values in flat_dc,
+// with w == NULL the symbols are only counted. With copy the output tables have to be the ones of
+// the input and the MCUs that do not change are copied as they are. Returns the position after the
+// scan or 0 on errors.
+size_t jpeg_transcode(Jpeg *jpeg, Coverage *flat, int *flat_dc, Jpeg_Writer *w, long (*frequencies)[2][256], bool copy) {
+    Jpeg_Reader r = { .data = jpeg->data, .size = jpeg->size, .pos = jpeg->scan_data };
+    bool interleaved = jpeg->component_count > 1;
+    int mcu_width  = interleaved ? 8*jpeg->h_max : 8;
+    int mcu_height = interleaved ? 8*jpeg->v_max : 8;
+    int mcus_x = (jpeg->width  + mcu_width  - 1) / mcu_width;
+    int mcus_y = (jpeg->height + mcu_height - 1) / mcu_height;
+    int interval = jpeg->restart_interval;
+    for (int i=0; i<jpeg->component_count; i++) {
+        jpeg->components[i].prediction = 0;
+        jpeg->components[i].written = 0;
+    }
+
+    int16_t coefficients[64];
+    Jpeg_Reader run = r; // where the MCUs start that are copied as they are
+    bool running = false;
+    size_t band = 0, span = 0, restarts = 0;
+    int row = -1;
+    for (int mcu=0; mcu<mcus_x*mcus_y; mcu++) {
+        int mx = mcu % mcus_x, my = mcu / mcus_x;
+        if (interval > 0 && mcu % interval == 0) {
+            if (running) jpeg_copy_bits(w, run, &r);
+            running = false;
+            if (mcu > 0) {
+                // the data of the interval ends at the RSTn marker
+                r.bits = 0;
+                r.count = 0;
+                r.pos = jpeg_next_marker(r.data, r.size, r.pos);
+                if (r.pos == r.size || (r.data[r.pos+1] & 0xF8) != 0xD0) return 0;
+                r.pos += 2;
+                if (w != NULL) {
+                    jpeg_writer_flush(w);
+                    byte_da_append(&w->bytes, 0xFF);
+                    byte_da_append(&w->bytes, 0xD0 + restarts % 8);
+                }
+                restarts++;
+                for (int i=0; i<jpeg->component_count; i++) {
+                    jpeg->components[i].prediction = 0;
+                    jpeg->components[i].written = 0;
+                }
+            }
+            int last_row = (MIN(mcu + interval, mcus_x*mcus_y) - 1) / mcus_x;
+            bool changed = false;
+            for (size_t b=band; b<flat->count && flat->items[b].y0 <= last_row; b++) {
+                if (flat->items[b].y1 > my) changed = true;
+            }
+            if (copy && !changed) {
+                // the interval is copied without decoding it
+                size_t end = jpeg_next_marker(r.data, r.size, r.pos);
+                for (; r.pos < end; r.pos++) byte_da_append(&w->bytes, r.data[r.pos]);
+                mcu += interval - 1;
+                continue;
+            }
+        }
+        if (my != row) {
+            row = my;
+            span = 0;
+            while (band < flat->count && flat->items[band].y1 <= my) band++;
+        }
+        bool is_flat = false;
+        if (band < flat->count && flat->items[band].y0 <= my) {
+            Coverage_Band *b = &flat->items[band];
+            while (span < b->count && b->spans[span].x1 <= mx) span++;
+            is_flat = span < b->count && b->spans[span].x0 <= mx;
+        }
+        // the MCU is written as it is if it keeps its coefficients and the DC predictions agree
+        bool same = copy && !is_flat;
+        for (int i=0; i<jpeg->component_count; i++) {
+            if (jpeg->components[i].prediction != jpeg->components[i].written) same = false;
+        }
+        if (same && !running) run = r;
+        if (!same && running) jpeg_copy_bits(w, run, &r);
+        running = same;
+
+        for (int i=0; i<jpeg->component_count; i++) {
+            Jpeg_Component *c = &jpeg->components[i];
+            int blocks = interleaved ? c->h * c->v : 1;
+            for (int k=0; k<blocks; k++) {
+                if (!jpeg_decode_block(&r, jpeg, c, coefficients)) return 0;
+                if (same) continue;
+                if (is_flat) {
+                    memset(coefficients, 0, sizeof(coefficients));
+                    coefficients[0] = flat_dc[i];
+                }
+                if (!jpeg_encode_block(w, jpeg, c, coefficients, frequencies)) return 0;
+            }
+            if (same) c->written = c->prediction;
+        }
     }
+    if (running) jpeg_copy_bits(w, run, &r);
+    if (w != NULL) jpeg_writer_flush(w);
+    return r.pos;
 }
 
-void click(Draw_Context *ctx) {
-    Rectangle screen = window_rectangle();
-    Rectangle image_part = {
-        .width  = screen.width  / ctx->scale,
-        .height = screen.height / ctx->scale,
-        .x = ctx->center.x - 0.5f * screen.width  / ctx->scale,
-        .y = ctx->center.y - 0.5f * screen.height / ctx->scale,
+// writes the JPEG at source with the blocks in color to path, returns false if source is not
+// supported or anything else fails. A gray JPEG can only take gray blocks, other colors need
+// the pixel path that adds the color channels.
+bool jpeg_redact(const char *source, const char *path, Texel_Rectangle *blocks, size_t block_count, Color color) {
+    Jpeg jpeg = {0};
+    Jpeg_Writer w = {0};
+    Byte_DA tables = {0};
+    Arena arena = {0};
+    bool ok = false;
+    FILE *f = fopen(source, "rb");
+    if (f == NULL) return false;
+    if (fseek(f, 0, SEEK_END) == 0 && (jpeg.size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        jpeg.data = malloc(jpeg.size);
+        assert(jpeg.data != NULL);
+        if (fread(jpeg.data, jpeg.size, 1, f) != 1) jpeg.size = 0;
+    }
+    fclose(f);
+    if (jpeg.data == NULL || !jpeg_parse(&jpeg)) goto defer;
+    if (jpeg.component_count == 1 && !(color.r == color.g && color.g == color.b)) goto defer;
+
+    // the MCUs that intersect a block, in units of MCUs
+    bool interleaved = jpeg.component_count > 1;
+    int mcu_width  = interleaved ? 8*jpeg.h_max : 8;
+    int mcu_height = interleaved ? 8*jpeg.v_max : 8;
+    Rectangle *rects = arena_alloc(&arena, sizeof(*rects) * MAX(block_count, 1));
+    for (size_t i=0; i<block_count; i++) {
+        Texel_Rectangle t = blocks[i];
+        int x0 = t.x0 / mcu_width, y0 = t.y0 / mcu_height;
+        int x1 = (t.x1 + mcu_width - 1) / mcu_width, y1 = (t.y1 + mcu_height - 1) / mcu_height;
+        rects[i] = (Rectangle) { .x = x0, .y = y0, .width = MAX(0, x1 - x0), .height = MAX(0, y1 - y0) };
+    }
+    Rectangle mcus = {
+        .x = 0, .y = 0,
+        .width  = (jpeg.width  + mcu_width  - 1) / mcu_width,
+        .height = (jpeg.height + mcu_height - 1) / mcu_height,
     };
+    Coverage flat = coverage(rects, block_count, mcus, &arena);
 
-    Rectangle screen_to_tex = rectangle_multiply(
-            rectangle_invert(screen),
-            image_part
-            );
-    Vector2 mouse_screen = get_mouse_position();
-    Vector2 mouse_tex    = rectangle_transform(mouse_screen, screen_to_tex);
+    // JFIF conversion to YCbCr, the DC coefficient of a flat block is 8 times its level shifted value
+    float levels[3] = {
+         0.299f    * color.r + 0.587f    * color.g + 0.114f    * color.b,
+        -0.16874f  * color.r - 0.33126f  * color.g + 0.5f      * color.b + 128,
+         0.5f      * color.r - 0.41869f  * color.g - 0.08131f  * color.b + 128,
+    };
+    int flat_dc[3];
+    for (int i=0; i<jpeg.component_count; i++) {
+        int q = jpeg.quant[jpeg.components[i].quant][0];
+        if (q == 0) goto defer;
+        flat_dc[i] = lroundf(8 * (levels[i] - 128) / q);
+    }
 
-    if (in_rectangle(mouse_tex, image_rectangle(ctx))) {
-        push_point(&ctx->stack, mouse_tex);
+    // the tables of the input lack a symbol only in rare cases
+    for (int id=0; id<4; id++) {
+        jpeg.dc_out[id] = jpeg.dc[id];
+        jpeg.ac_out[id] = jpeg.ac[id];
+        huffman_encoding(&jpeg.dc_out[id]);
+        huffman_encoding(&jpeg.ac_out[id]);
+    }
+    size_t end = jpeg_transcode(&jpeg, &flat, flat_dc, &w, NULL, true);
+    if (end == 0) {
+        long frequencies[4][2][256] = {0};
+        if (jpeg_transcode(&jpeg, &flat, flat_dc, NULL, frequencies, false) == 0) goto defer;
+        bool used[4][2] = {0};
+        for (int i=0; i<jpeg.component_count; i++) {
+            used[jpeg.components[i].dc][0] = true;
+            used[jpeg.components[i].ac][1] = true;
+        }
+        for (int id=0; id<4; id++) {
+            for (int class=0; class<2; class++) {
+                if (!used[id][class]) continue;
+                Huffman_Table *t = class == 0 ? &jpeg.dc_out[id] : &jpeg.ac_out[id];
+                huffman_optimal(t, frequencies[id][class]);
+                huffman_encoding(t);
+                byte_da_append(&tables, class << 4 | id);
+                int count = 0;
+                for (int l=1; l<=16; l++) {
+                    byte_da_append(&tables, t->lengths[l]);
+                    count += t->lengths[l];
+                }
+                for (int k=0; k<count; k++) byte_da_append(&tables, t->values[k]);
+            }
+        }
+        w = (Jpeg_Writer) { .bytes = w.bytes };
+        w.bytes.count = 0;
+        end = jpeg_transcode(&jpeg, &flat, flat_dc, &w, NULL, false);
+        if (end == 0) goto defer;
+    }
+    // only files with a single scan are supported, after it has to come the end
+    end = jpeg_next_marker(jpeg.data, jpeg.size, end);
+    if (end == jpeg.size || jpeg.data[end+1] != 0xD9) goto defer;
+
+    f = fopen(path, "wb");
+    if (f != NULL) {
+        // NOTE: a DHT segment after the ones of the input replaces their tables
+        uint8_t dht[4] = { 0xFF, 0xC4, (tables.count + 2) >> 8, (tables.count + 2) & 0xFF };
+        size_t scan_header_size = jpeg.scan_data - jpeg.scan_header;
+        static const uint8_t eoi[] = { 0xFF, 0xD9 };
+        ok = fwrite(jpeg.header.items, jpeg.header.count, 1, f) == 1
+          && (tables.count == 0 || (fwrite(dht, sizeof(dht), 1, f) == 1 && fwrite(tables.items, tables.count, 1, f) == 1))
+          && fwrite(&jpeg.data[jpeg.scan_header], scan_header_size, 1, f) == 1
+          && (w.bytes.count == 0 || fwrite(w.bytes.items, w.bytes.count, 1, f) == 1)
+          && fwrite(eoi, sizeof(eoi), 1, f) == 1;
+        ok = fclose(f) == 0 && ok;
     }
+
+defer:
+    free(tables.items);
+    free(jpeg.data);
+    free(jpeg.header.items);
+    free(w.bytes.items);
+    arena_free(&arena);
+    return ok;
 }
 
-void pan_down(Draw_Context *ctx) {
-    Rectangle screen = window_rectangle();
-    float d = PAN_STEP * screen.height / ctx->scale;
-    ctx->center.y += d;
+// JPEG encoding
+//
+// NOTE: stbi_write_jpg converts, transforms and codes one 8x8 block at a time with scalar code and
+// a fixed chroma subsampling. jpeg_write converts the colors of a whole MCU row at once, computes
+// the AAN DCT of 8 rows or columns at a time with AVX and quantizes with the reciprocals of the
+// quantization steps, scaled like the DCT, the way stbi_write_jpg does. Every MCU row is a restart
+// interval of its own, so the rows are encoded independently on export_pool.
+
+// natural index of the coefficients in zigzag order
+const uint8_t jpeg_natural_order[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+typedef struct {
+    File_Writer *out;
+    int width, height;
+    int channels;    // of the pushed pixels, gray (and alpha) pixels are encoded as a gray JPEG
+    int h, v;        // sampling factors of the luma, the chroma is sampled once per MCU
+    int mcus_x, mcus_y;
+    int band_rows;   // rows that are pushed at once, one MCU row per thread of export_pool
+    int mcu_y;       // first MCU row of the band
+    int count;       // rows in the band
+    uint8_t *pixels; // of the band, row by row
+    Jpeg jpeg;       // the components and the huffman tables
+    float divisors[2][64]; // luma and chroma, in natural order
+    Jpeg_Writer *rows;     // the entropy coded data of the MCU rows of the band
+} Jpeg_Encoder;
+
+// the AAN DCT of d[0], d[step], ..., d[7*step], scaled by 8 times the factors in jpeg_write
+void fdct(float *d, size_t step) {
+    float tmp0 = d[0*step] + d[7*step];
+    float tmp7 = d[0*step] - d[7*step];
+    float tmp1 = d[1*step] + d[6*step];
+    float tmp6 = d[1*step] - d[6*step];
+    float tmp2 = d[2*step] + d[5*step];
+    float tmp5 = d[2*step] - d[5*step];
+    float tmp3 = d[3*step] + d[4*step];
+    float tmp4 = d[3*step] - d[4*step];
+
+    float tmp10 = tmp0 + tmp3;
+    float tmp13 = tmp0 - tmp3;
+    float tmp11 = tmp1 + tmp2;
+    float tmp12 = tmp1 - tmp2;
+    d[0*step] = tmp10 + tmp11;
+    d[4*step] = tmp10 - tmp11;
+    float z1 = (tmp12 + tmp13) * 0.707106781f;
+    d[2*step] = tmp13 + z1;
+    d[6*step] = tmp13 - z1;
+
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+    float z5 = (tmp10 - tmp12) * 0.382683433f;
+    float z2 = tmp10 * 0.541196100f + z5;
+    float z4 = tmp12 * 1.306562965f + z5;
+    float z3 = tmp11 * 0.707106781f;
+    float z11 = tmp7 + z3;
+    float z13 = tmp7 - z3;
+    d[5*step] = z13 + z2;
+    d[3*step] = z13 - z2;
+    d[1*step] = z11 + z4;
+    d[7*step] = z11 - z4;
 }
 
-void pan_up(Draw_Context *ctx) {
-    Rectangle screen = window_rectangle();
-    float d = PAN_STEP * screen.height / ctx->scale;
-    ctx->center.y -= d;
+#if defined(__AVX2__)
+// fdct of the 8 lanes of d at once
+void fdct_avx2(__m256 *d) {
+    __m256 tmp0 = _mm256_add_ps(d[0], d[7]);
+    __m256 tmp7 = _mm256_sub_ps(d[0], d[7]);
+    __m256 tmp1 = _mm256_add_ps(d[1], d[6]);
+    __m256 tmp6 = _mm256_sub_ps(d[1], d[6]);
+    __m256 tmp2 = _mm256_add_ps(d[2], d[5]);
+    __m256 tmp5 = _mm256_sub_ps(d[2], d[5]);
+    __m256 tmp3 = _mm256_add_ps(d[3], d[4]);
+    __m256 tmp4 = _mm256_sub_ps(d[3], d[4]);
+
+    __m256 tmp10 = _mm256_add_ps(tmp0, tmp3);
+    __m256 tmp13 = _mm256_sub_ps(tmp0, tmp3);
+    __m256 tmp11 = _mm256_add_ps(tmp1, tmp2);
+    __m256 tmp12 = _mm256_sub_ps(tmp1, tmp2);
+    d[0] = _mm256_add_ps(tmp10, tmp11);
+    d[4] = _mm256_sub_ps(tmp10, tmp11);
+    __m256 z1 = _mm256_mul_ps(_mm256_add_ps(tmp12, tmp13), _mm256_set1_ps(0.707106781f));
+    d[2] = _mm256_add_ps(tmp13, z1);
+    d[6] = _mm256_sub_ps(tmp13, z1);
+
+    tmp10 = _mm256_add_ps(tmp4, tmp5);
+    tmp11 = _mm256_add_ps(tmp5, tmp6);
+    tmp12 = _mm256_add_ps(tmp6, tmp7);
+    __m256 z5 = _mm256_mul_ps(_mm256_sub_ps(tmp10, tmp12), _mm256_set1_ps(0.382683433f));
+    __m256 z2 = _mm256_add_ps(_mm256_mul_ps(tmp10, _mm256_set1_ps(0.541196100f)), z5);
+    __m256 z4 = _mm256_add_ps(_mm256_mul_ps(tmp12, _mm256_set1_ps(1.306562965f)), z5);
+    __m256 z3 = _mm256_mul_ps(tmp11, _mm256_set1_ps(0.707106781f));
+    __m256 z11 = _mm256_add_ps(tmp7, z3);
+    __m256 z13 = _mm256_sub_ps(tmp7, z3);
+    d[5] = _mm256_add_ps(z13, z2);
+    d[3] = _mm256_sub_ps(z13, z2);
+    d[1] = _mm256_add_ps(z11, z4);
+    d[7] = _mm256_sub_ps(z11, z4);
 }
 
-void pan_left(Draw_Context *ctx) {
-    Rectangle screen = window_rectangle();
-    float d = PAN_STEP * screen.width / ctx->scale;
-    ctx->center.x -= d;
+// transpose the 8x8 matrix with the rows r[0], ..., r[7]
+void transpose_avx2(__m256 *r) {
+    __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+    __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+    __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+    __m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+    __m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+    r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+    r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+    r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+    r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+    r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+    r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+    r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
 }
+#endif
 
-void pan_right(Draw_Context *ctx) {
-    Rectangle screen = window_rectangle();
-    float d = PAN_STEP * screen.width / ctx->scale;
-    ctx->center.x += d;
+// transforms and quantizes the 8x8 samples at plane, writes the coefficients in zigzag order
+void jpeg_quantize_block(const float *plane, size_t stride, const float *divisors, int16_t *coefficients) {
+    int32_t quantized[64];
+#if defined(__AVX2__)
+    __m256 d[8];
+    for (int i=0; i<8; i++) d[i] = _mm256_loadu_ps(&plane[i*stride]);
+    // the rows first, like stbi_write_jpg
+    transpose_avx2(d);
+    fdct_avx2(d);
+    transpose_avx2(d);
+    fdct_avx2(d);
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 half = _mm256_set1_ps(0.5f);
+    for (int i=0; i<8; i++) {
+        __m256 v = _mm256_mul_ps(d[i], _mm256_loadu_ps(&divisors[i*8]));
+        // round half away from zero
+        v = _mm256_add_ps(v, _mm256_or_ps(half, _mm256_and_ps(v, sign)));
+        _mm256_storeu_si256((__m256i*) &quantized[i*8], _mm256_cvttps_epi32(v));
+    }
+#else
+    float d[64];
+    for (int i=0; i<8; i++) memcpy(&d[i*8], &plane[i*stride], sizeof(*d) * 8);
+    for (int i=0; i<8; i++) fdct(&d[i*8], 1);
+    for (int i=0; i<8; i++) fdct(&d[i], 8);
+    for (int i=0; i<64; i++) {
+        float v = d[i] * divisors[i];
+        quantized[i] = v < 0 ? v - 0.5f : v + 0.5f;
+    }
+#endif
+    for (int k=0; k<64; k++) coefficients[k] = quantized[jpeg_natural_order[k]];
 }
 
-// center and rescale the image view such that it fits in the window and is as big as possible
-void fit(Draw_Context *ctx) {
-    Vector2 half = {.x = 0.5, .y = 0.5};
-    ctx->center = rectangle_transform(half, image_rectangle(ctx));
-    Rectangle screen = window_rectangle();
-    float ws = screen.width / ctx->width;
-    float hs = screen.height / ctx->height;
-    ctx->scale = fminf(ws, hs);
+// converts RGB or RGBA pixels to level shifted YCbCr
+void jpeg_convert_row(const uint8_t *pixels, int channels, int count, float *y, float *cb, float *cr) {
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i mask = _mm256_set1_epi32(0xFF);
+    // moves 8 RGB pixels into 32 bit lanes, the load of 32 bytes has to stay inside of the row
+    const __m256i rgb_lanes = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+    const __m256i rgb_shuffle = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    for (; i + (channels == 3 ? 11 : 8) <= count; i+=8) {
+        __m256i p = _mm256_loadu_si256((__m256i*) &pixels[i*channels]);
+        if (channels == 3) p = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(p, rgb_lanes), rgb_shuffle);
+        __m256 r = _mm256_cvtepi32_ps(_mm256_and_si256(p, mask));
+        __m256 g = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 8), mask));
+        __m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 16), mask));
+        __m256 luma = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.29900f)), _mm256_mul_ps(g, _mm256_set1_ps(0.58700f))), _mm256_mul_ps(b, _mm256_set1_ps(0.11400f)));
+        __m256 blue = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(-0.16874f)), _mm256_mul_ps(g, _mm256_set1_ps(-0.33126f))), _mm256_mul_ps(b, _mm256_set1_ps(0.50000f)));
+        __m256 red = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.50000f)), _mm256_mul_ps(g, _mm256_set1_ps(-0.41869f))), _mm256_mul_ps(b, _mm256_set1_ps(-0.08131f)));
+        _mm256_storeu_ps(&y[i], _mm256_sub_ps(luma, _mm256_set1_ps(128)));
+        _mm256_storeu_ps(&cb[i], blue);
+        _mm256_storeu_ps(&cr[i], red);
+    }
+#endif
+    for (; i<count; i++) {
+        float r = pixels[i*channels + 0], g = pixels[i*channels + 1], b = pixels[i*channels + 2];
+        y[i]  =  0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
+        cb[i] = -0.16874f*r - 0.33126f*g + 0.50000f*b;
+        cr[i] =  0.50000f*r - 0.41869f*g - 0.08131f*b;
+    }
 }
 
-void export(Draw_Context *ctx, const char *path) {
-    for (size_t i=0; i<ctx->stack.cursor/2; i++) {
-        Rectangle rec = hull(ctx->stack.items[2*i], ctx->stack.items[2*i+1]);
+// the level shifted luma of gray or gray and alpha pixels
+void jpeg_convert_gray_row(const uint8_t *pixels, int channels, int count, float *y) {
+    int i = 0;
+#if defined(__AVX2__)
+    if (channels == 1) {
+        for (; i+8 <= count; i+=8) {
+            __m256i p = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) &pixels[i]));
+            _mm256_storeu_ps(&y[i], _mm256_sub_ps(_mm256_cvtepi32_ps(p), _mm256_set1_ps(128)));
+        }
+    }
+#endif
+    for (; i<count; i++) y[i] = pixels[i*channels] - 128.0f;
+}
 
-        for (int i=MAX(rec.y, 0); i<MIN(rec.y+rec.height, ctx->height-1); i++) {
-            for (int j=MAX(rec.x, 0); j<MIN(rec.x+rec.width, ctx->width-1); j++) {
-                blend_color(ctx->pixel_data, i*ctx->width + j, block_color);
+// averages each sample of 8 rows of a plane with half as many columns over the 2x1 (v = 1) or 2x2
+// (v = 2) samples of the plane it covers, in place
+void jpeg_downsample(float *plane, int stride, int v) {
+    int half = stride / 2;
+    for (int i=0; i<8; i++) {
+        float *top = &plane[i*v*stride];
+        float *bottom = v == 2 ? top + stride : NULL;
+        float *out = &plane[i*half];
+        int j = 0;
+#if defined(__AVX2__)
+        __m256 scale = _mm256_set1_ps(v == 2 ? 0.25f : 0.5f);
+        for (; j+8 <= half; j+=8) {
+            __m256 a = _mm256_loadu_ps(&top[2*j]);
+            __m256 b = _mm256_loadu_ps(&top[2*j + 8]);
+            if (v == 2) {
+                a = _mm256_add_ps(a, _mm256_loadu_ps(&bottom[2*j]));
+                b = _mm256_add_ps(b, _mm256_loadu_ps(&bottom[2*j + 8]));
             }
+            // the sums of neighbouring pairs, hadd mixes the 128 bit halves of a and b
+            __m256 sums = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_hadd_ps(a, b)), 0xD8));
+            _mm256_storeu_ps(&out[j], _mm256_mul_ps(sums, scale));
+        }
+#endif
+        for (; j<half; j++) {
+            float sum = top[2*j] + top[2*j + 1];
+            if (v == 2) sum += bottom[2*j] + bottom[2*j + 1];
+            out[j] = sum * (v == 2 ? 0.25f : 0.5f);
         }
     }
+}
 
-    const char *ext = get_file_ext(path);
-    if (strcmp(ext, ".png") == 0) {
-        if (!stbi_write_png(path, ctx->width, ctx->height, 4, ctx->pixel_data, 4*ctx->width)) {
-            UNIMPLEMENTED("export");
+void jpeg_encode_task(void *arg, size_t index) {
+    Jpeg_Encoder *job = arg;
+    bool gray = job->jpeg.component_count == 1;
+    int rows = 8*job->v;
+    int stride = 8*job->h*job->mcus_x; // samples per row of the planes, a multiple of 8 for the DCT
+    int chroma_stride = stride / job->h;
+    float *y  = malloc(sizeof(*y) * stride * rows);
+    float *cb = gray ? NULL : malloc(sizeof(*cb) * stride * rows);
+    float *cr = gray ? NULL : malloc(sizeof(*cr) * stride * rows);
+    assert(y != NULL && (gray || (cb != NULL && cr != NULL)));
+
+    // the pixels past the edges of the image repeat the last row and column
+    for (int i=0; i<rows; i++) {
+        int row = MIN((int) index*rows + i, job->count - 1);
+        const uint8_t *pixels = &job->pixels[(size_t) row * job->width * job->channels];
+        float *yi = &y[i*stride];
+        if (gray) {
+            jpeg_convert_gray_row(pixels, job->channels, job->width, yi);
+            for (int j=job->width; j<stride; j++) yi[j] = yi[job->width - 1];
+            continue;
         }
-    } else if (strcmp(ext, ".bmp") == 0) {
-        if (!stbi_write_bmp(path, ctx->width, ctx->height, 4, ctx->pixel_data)) {
-            UNIMPLEMENTED("export");
+        float *cbi = &cb[i*stride], *cri = &cr[i*stride];
+        jpeg_convert_row(pixels, job->channels, job->width, yi, cbi, cri);
+        for (int j=job->width; j<stride; j++) {
+            yi[j]  = yi[job->width - 1];
+            cbi[j] = cbi[job->width - 1];
+            cri[j] = cri[job->width - 1];
         }
-    } else if (strcmp(ext, ".tga") == 0) {
-        if (!stbi_write_tga(path, ctx->width, ctx->height, 4, ctx->pixel_data)) {
-            UNIMPLEMENTED("export");
+    }
+    if (job->h > 1) {
+        jpeg_downsample(cb, stride, job->v);
+        jpeg_downsample(cr, stride, job->v);
+    }
+
+    Jpeg_Writer *w = &job->rows[index];
+    w->bytes.count = 0;
+    Jpeg_Component components[3];
+    memcpy(components, job->jpeg.components, sizeof(components));
+    int16_t coefficients[64];
+    for (int mx=0; mx<job->mcus_x; mx++) {
+        for (int by=0; by<job->v; by++) {
+            for (int bx=0; bx<job->h; bx++) {
+                jpeg_quantize_block(&y[by*8*stride + (mx*job->h + bx)*8], stride, job->divisors[0], coefficients);
+                jpeg_encode_block(w, &job->jpeg, &components[0], coefficients, NULL);
+            }
         }
-    } else if (strcmp(ext, ".jpg") == 0) {
-        if (!stbi_write_jpg(path, ctx->width, ctx->height, 4, ctx->pixel_data, 50)) {
-            UNIMPLEMENTED("export");
+        if (gray) continue;
+        jpeg_quantize_block(&cb[mx*8], chroma_stride, job->divisors[1], coefficients);
+        jpeg_encode_block(w, &job->jpeg, &components[1], coefficients, NULL);
+        jpeg_quantize_block(&cr[mx*8], chroma_stride, job->divisors[1], coefficients);
+        jpeg_encode_block(w, &job->jpeg, &components[2], coefficients, NULL);
+    }
+    jpeg_writer_flush(w);
+    free(y);
+    free(cb);
+    free(cr);
+}
+
+void huffman_table_init(Huffman_Table *t, const uint8_t *lengths, const uint8_t *values) {
+    int count = 0;
+    t->lengths[0] = 0;
+    for (int l=1; l<=16; l++) {
+        t->lengths[l] = lengths[l-1];
+        count += lengths[l-1];
+    }
+    memcpy(t->values, values, count);
+    huffman_encoding(t);
+}
+
+// writes the header of a baseline JPEG with the quality (1 to 100) and chroma subsampling, the
+// quantization and huffman tables are the ones of stbi_write_jpg. The rows are pushed in bands
+// of band_rows, every MCU row is a restart interval so that they can be encoded independently.
+// Pixels with 1 or 2 channels give a JPEG with only the luma component, alpha is dropped.
+void jpeg_encoder_open(Jpeg_Encoder *job, File_Writer *out, int width, int height, int channels, int quality, Subsampling subsampling) {
+    // the example tables in annex K of the JPEG standard
+    static const uint8_t luma_quant[64] = {
+        16, 11, 10, 16,  24,  40,  51,  61, 12, 12, 14, 19,  26,  58,  60,  55,
+        14, 13, 16, 24,  40,  57,  69,  56, 14, 17, 22, 29,  51,  87,  80,  62,
+        18, 22, 37, 56,  68, 109, 103,  77, 24, 35, 55, 64,  81, 104, 113,  92,
+        49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103,  99,
+    };
+    static const uint8_t chroma_quant[64] = {
+        17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+        24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    };
+    static const uint8_t dc_lengths[2][16] = {
+        {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0},
+        {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
+    };
+    static const uint8_t dc_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+    static const uint8_t ac_lengths[2][16] = {
+        {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d},
+        {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77},
+    };
+    static const uint8_t ac_values[2][162] = {
+        {
+            0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
+            0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+            0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
+            0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+            0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
+            0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+            0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa,
+        },
+        {
+            0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
+            0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+            0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
+            0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+            0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
+            0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+            0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa,
+        },
+    };
+    // the scale factors of the AAN DCT
+    static const float aan[8] = {
+        1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+        1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f,
+    };
+
+    if (subsampling == SUBSAMPLING_AUTO) subsampling = quality <= 90 ? SUBSAMPLING_420 : SUBSAMPLING_444;
+    quality = MAX(1, MIN(100, quality));
+    int scale = quality < 50 ? 5000 / quality : 200 - 2*quality;
+
+    size_t threads = MAX(export_pool.thread_count, 1);
+    *job = (Jpeg_Encoder) {0};
+    job->out = out;
+    job->width = width;
+    job->height = height;
+    job->channels = channels;
+    bool gray = channels <= 2;
+    job->h = gray || subsampling == SUBSAMPLING_444 ? 1 : 2;
+    job->v = !gray && subsampling == SUBSAMPLING_420 ? 2 : 1;
+    job->mcus_x = (width  + 8*job->h - 1) / (8*job->h);
+    job->mcus_y = (height + 8*job->v - 1) / (8*job->v);
+    job->band_rows = 8*job->v * threads;
+    job->rows = calloc(threads, sizeof(*job->rows));
+    assert(job->rows != NULL);
+
+    Jpeg *jpeg = &job->jpeg;
+    for (int k=0; k<64; k++) {
+        jpeg->quant[0][k] = MAX(1, MIN(255, (luma_quant[k]   * scale + 50) / 100));
+        jpeg->quant[1][k] = MAX(1, MIN(255, (chroma_quant[k] * scale + 50) / 100));
+        job->divisors[0][k] = 1 / (jpeg->quant[0][k] * aan[k/8] * aan[k%8]);
+        job->divisors[1][k] = 1 / (jpeg->quant[1][k] * aan[k/8] * aan[k%8]);
+    }
+    for (int i=0; i<2; i++) {
+        huffman_table_init(&jpeg->dc_out[i], dc_lengths[i], dc_values);
+        huffman_table_init(&jpeg->ac_out[i], ac_lengths[i], ac_values[i]);
+    }
+    jpeg->component_count = gray ? 1 : 3;
+    int table_count = gray ? 1 : 2; // of each kind
+    for (int i=0; i<jpeg->component_count; i++) {
+        jpeg->components[i] = (Jpeg_Component) {
+            .id = i + 1,
+            .h = i == 0 ? job->h : 1,
+            .v = i == 0 ? job->v : 1,
+            .quant = i > 0, .dc = i > 0, .ac = i > 0,
+        };
+    }
+
+    Byte_DA header = {0};
+    static const uint8_t jfif[] = { 0xFF, 0xD8, 0xFF, 0xE0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+    for (size_t i=0; i<sizeof(jfif); i++) byte_da_append(&header, jfif[i]);
+    uint8_t dqt[] = { 0xFF, 0xDB, 0, 2 + table_count*65 };
+    for (size_t i=0; i<sizeof(dqt); i++) byte_da_append(&header, dqt[i]);
+    for (int i=0; i<table_count; i++) {
+        byte_da_append(&header, i);
+        for (int k=0; k<64; k++) byte_da_append(&header, jpeg->quant[i][jpeg_natural_order[k]]);
+    }
+    uint8_t sof[] = {
+        0xFF, 0xC0, 0, 8 + 3*jpeg->component_count, 8,
+        height >> 8, height & 0xFF, width >> 8, width & 0xFF, jpeg->component_count,
+    };
+    for (size_t i=0; i<sizeof(sof); i++) byte_da_append(&header, sof[i]);
+    for (int i=0; i<jpeg->component_count; i++) {
+        Jpeg_Component *c = &jpeg->components[i];
+        byte_da_append(&header, c->id);
+        byte_da_append(&header, c->h << 4 | c->v);
+        byte_da_append(&header, c->quant);
+    }
+    Byte_DA tables = {0};
+    for (int class=0; class<2; class++) {
+        for (int id=0; id<table_count; id++) {
+            Huffman_Table *t = class == 0 ? &jpeg->dc_out[id] : &jpeg->ac_out[id];
+            byte_da_append(&tables, class << 4 | id);
+            int count = 0;
+            for (int l=1; l<=16; l++) {
+                byte_da_append(&tables, t->lengths[l]);
+                count += t->lengths[l];
+            }
+            for (int k=0; k<count; k++) byte_da_append(&tables, t->values[k]);
+        }
+    }
+    byte_da_append(&header, 0xFF);
+    byte_da_append(&header, 0xC4);
+    byte_da_append(&header, (tables.count + 2) >> 8);
+    byte_da_append(&header, (tables.count + 2) & 0xFF);
+    for (size_t i=0; i<tables.count; i++) byte_da_append(&header, tables.items[i]);
+    uint8_t dri_sos[] = {
+        0xFF, 0xDD, 0, 4, job->mcus_x >> 8, job->mcus_x & 0xFF,
+        0xFF, 0xDA, 0, 6 + 2*jpeg->component_count, jpeg->component_count,
+    };
+    for (size_t i=0; i<sizeof(dri_sos); i++) byte_da_append(&header, dri_sos[i]);
+    for (int i=0; i<jpeg->component_count; i++) {
+        byte_da_append(&header, jpeg->components[i].id);
+        byte_da_append(&header, jpeg->components[i].dc << 4 | jpeg->components[i].ac);
+    }
+    static const uint8_t spectral[] = { 0, 63, 0 }; // baseline: all coefficients in one scan
+    for (size_t i=0; i<sizeof(spectral); i++) byte_da_append(&header, spectral[i]);
+
+    file_write(out, header.items, header.count);
+    free(header.items);
+    free(tables.items);
+}
+
+// the next count rows, at most band_rows and a multiple of the MCU height unless they are the last
+void jpeg_encoder_push(Jpeg_Encoder *job, uint8_t *pixels, int count) {
+    int mcu_rows = (count + 8*job->v - 1) / (8*job->v);
+    assert(0 < count && count <= job->band_rows && job->mcu_y + mcu_rows <= job->mcus_y);
+    job->pixels = pixels;
+    job->count = count;
+    pool_run(&export_pool, jpeg_encode_task, job, mcu_rows);
+    for (int k=0; k<mcu_rows; k++) {
+        int row = job->mcu_y + k;
+        uint8_t restart[] = { 0xFF, 0xD0 + (row-1) % 8 };
+        if (row > 0) file_write(job->out, restart, sizeof(restart));
+        file_write(job->out, job->rows[k].bytes.items, job->rows[k].bytes.count);
+    }
+    job->mcu_y += mcu_rows;
+}
+
+void jpeg_encoder_close(Jpeg_Encoder *job) {
+    assert(job->mcu_y == job->mcus_y);
+    static const uint8_t eoi[] = { 0xFF, 0xD9 };
+    file_write(job->out, eoi, sizeof(eoi));
+    for (int k=0; k<job->band_rows / (8*job->v); k++) free(job->rows[k].bytes.items);
+    free(job->rows);
+}
+
+void put_u16_le(uint8_t *out, uint16_t v) {
+    out[0] = v;
+    out[1] = v >> 8;
+}
+
+void put_u32_le(uint8_t *out, uint32_t v) {
+    put_u16_le(&out[0], v);
+    put_u16_le(&out[2], v >> 16);
+}
+
+// converts count pixels to dst_channels (3 or 4 unless they are equal), gray becomes RGB and a
+// missing alpha channel becomes 255
+void convert_pixels(uint8_t *dst, int dst_channels, const uint8_t *src, int src_channels, size_t count) {
+    if (dst_channels == src_channels) {
+        memcpy(dst, src, count * src_channels);
+        return;
+    }
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+    if (dst_channels == 4 && src_channels == 3) {
+        // like in jpeg_convert_row, the load of 32 bytes has to stay inside of src
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+        const __m256i shuffle = _mm256_setr_epi8(
+            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        for (; i+11 <= count; i+=8) {
+            __m256i p = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*) &src[i*3]), lanes);
+            _mm256_storeu_si256((__m256i*) &dst[i*4], _mm256_or_si256(_mm256_shuffle_epi8(p, shuffle), alpha));
+        }
+    } else if (dst_channels == 4 && src_channels == 1) {
+        for (; i+8 <= count; i+=8) {
+            __m256i g = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) &src[i]));
+            g = _mm256_mullo_epi32(g, _mm256_set1_epi32(0x010101));
+            _mm256_storeu_si256((__m256i*) &dst[i*4], _mm256_or_si256(g, alpha));
+        }
+    }
+#endif
+    for (; i<count; i++) {
+        Color c = image_color(src, i, src_channels);
+        memcpy(&dst[i*dst_channels], &c, dst_channels);
+    }
+}
+
+// a BMP with a BITMAPV4HEADER like stbi_write_bmp, but stored top down (a negative height) so that
+// the rows can be written in the order they are pushed. 24 bits per pixel unless there is alpha.
+void bmp_write_header(File_Writer *out, int width, int height, int bytes_per_pixel) {
+    uint32_t row_size = ((uint32_t) width * bytes_per_pixel + 3) & ~3u;
+    uint8_t header[14 + 108] = { 'B', 'M' };
+    put_u32_le(&header[2], sizeof(header) + row_size * height);
+    put_u32_le(&header[10], sizeof(header)); // offset of the pixels
+    uint8_t *info = &header[14];
+    put_u32_le(&info[0], 108);
+    put_u32_le(&info[4], width);
+    put_u32_le(&info[8], -height);
+    put_u16_le(&info[12], 1); // planes
+    put_u16_le(&info[14], 8*bytes_per_pixel);
+    if (bytes_per_pixel == 4) {
+        put_u32_le(&info[16], 3); // BI_BITFIELDS
+        put_u32_le(&info[40], 0x00FF0000); // red mask
+        put_u32_le(&info[44], 0x0000FF00); // green mask
+        put_u32_le(&info[48], 0x000000FF); // blue mask
+        put_u32_le(&info[52], 0xFF000000); // alpha mask
+    }
+    file_write(out, header, sizeof(header));
+}
+
+// bgr is one row that was already converted, rows are padded to a multiple of 4 bytes
+void bmp_write_row(File_Writer *out, const uint8_t *bgr, int width, int bytes_per_pixel) {
+    static const uint8_t padding[3] = {0};
+    size_t size = (size_t) width * bytes_per_pixel;
+    file_write(out, bgr, size);
+    file_write(out, padding, (4 - size % 4) % 4);
+}
+
+// an RLE compressed TGA like stbi_write_tga, but with the origin at the top left
+void tga_write_header(File_Writer *out, int width, int height, int channels) {
+    uint8_t header[18] = {0};
+    header[2] = channels <= 2 ? 11 : 10; // RLE gray or RLE true color
+    put_u16_le(&header[12], width);
+    put_u16_le(&header[14], height);
+    header[16] = 8*channels; // bits per pixel
+    header[17] = 0x20 | (channels % 2 == 0 ? 8 : 0); // top left origin, bits of alpha
+    file_write(out, header, sizeof(header));
+}
+
+// packets of up to 128 equal pixels or of up to 128 pixels as they are, they never cross rows
+void tga_write_row(File_Writer *out, const uint8_t *pixels, int width, int channels) {
+    #define EQUAL(a, b) (memcmp(&pixels[(a)*channels], &pixels[(b)*channels], channels) == 0)
+    for (int j=0; j<width;) {
+        int n = 1;
+        if (j + 1 < width && EQUAL(j, j+1)) {
+            while (n < 128 && j + n < width && EQUAL(j+n, j)) n++;
+            uint8_t head = 0x80 | (n - 1);
+            file_write(out, &head, 1);
+            file_write(out, &pixels[j*channels], channels);
+        } else {
+            while (n < 128 && j + n < width && !(j + n + 1 < width && EQUAL(j+n, j+n+1))) n++;
+            uint8_t head = n - 1;
+            file_write(out, &head, 1);
+            file_write(out, &pixels[j*channels], (size_t) n * channels);
+        }
+        j += n;
+    }
+    #undef EQUAL
+}
+
+// the hashes of count pixels
+void qoi_hashes(const uint8_t *pixels, size_t count, uint8_t *hashes) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i weights = _mm256_set1_epi32(11 << 24 | 7 << 16 | 5 << 8 | 3);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i mask = _mm256_set1_epi32(63);
+    // the lowest byte of every 32 bit lane into the first 4 bytes of its 128 bit half
+    const __m256i gather = _mm256_setr_epi8(
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    for (; i+8 <= count; i+=8) {
+        __m256i p = _mm256_loadu_si256((const __m256i*) &pixels[i*4]);
+        __m256i sum = _mm256_madd_epi16(_mm256_maddubs_epi16(p, weights), ones);
+        __m256i h = _mm256_shuffle_epi8(_mm256_and_si256(sum, mask), gather);
+        uint32_t lo = _mm256_extract_epi32(h, 0), hi = _mm256_extract_epi32(h, 4);
+        memcpy(&hashes[i], &lo, 4);
+        memcpy(&hashes[i+4], &hi, 4);
+    }
+#endif
+    for (; i<count; i++) {
+        uint32_t px;
+        memcpy(&px, &pixels[i*4], 4);
+        hashes[i] = qoi_hash(px);
+    }
+}
+
+// the number of pixels at the start of px that are equal to previous
+size_t qoi_run_length(const uint32_t *px, size_t count, uint32_t previous) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i v = _mm256_set1_epi32(previous);
+    for (; i+8 <= count; i+=8) {
+        __m256i equal = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*) &px[i]), v);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(equal));
+        if (mask != 0xFF) return i + __builtin_ctz(~mask);
+    }
+#elif defined(__SSE2__)
+    __m128i v = _mm_set1_epi32(previous);
+    for (; i+4 <= count; i+=4) {
+        __m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) &px[i]), v);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(equal));
+        if (mask != 0xF) return i + __builtin_ctz(~mask);
+    }
+#endif
+    while (i < count && px[i] == previous) i++;
+    return i;
+}
+
+typedef struct {
+    uint32_t index[64]; // of the decoder at the first pixel of the chunk
+    uint32_t last[64];  // the last pixel of the chunk with each hash
+    uint64_t seen;      // the hashes that occur in the chunk
+    Byte_DA bytes;
+} Qoi_Chunk;
+
+// NOTE: the state of a QOI decoder at a pixel only depends on the pixels before it: the previous
+// pixel and for every hash the last pixel that had it. So the chunks of a band are encoded in
+// parallel, after their hashes were computed in parallel and the index at the start of every chunk
+// was put together from them. Runs end at the chunks, which costs a byte now and then.
+typedef struct {
+    File_Writer *out;
+    int width, height;
+    int rows_per_chunk;
+    int band_rows;        // rows that are pushed at once, one chunk per thread of export_pool
+    int y;                // first row of the band
+    int count;            // rows in the band
+    uint8_t *pixels;      // of the band
+    uint8_t *hashes;      // of the pixels of the band
+    uint32_t previous;    // the pixel before the band
+    uint32_t index[64];   // at the start of the band
+    size_t chunk_count;   // in the band
+    Qoi_Chunk *chunks;
+} Qoi_Encoder;
+
+void qoi_hash_task(void *arg, size_t index) {
+    Qoi_Encoder *job = arg;
+    Qoi_Chunk *chunk = &job->chunks[index];
+    size_t start = (size_t) index * job->rows_per_chunk * job->width;
+    size_t end = (size_t) MIN(job->count, (int) (index + 1) * job->rows_per_chunk) * job->width;
+    qoi_hashes(&job->pixels[start*4], end - start, &job->hashes[start]);
+    const uint32_t *px = (const uint32_t*) job->pixels;
+    chunk->seen = 0;
+    for (size_t i=start; i<end; i++) {
+        chunk->last[job->hashes[i]] = px[i];
+        chunk->seen |= (uint64_t) 1 << job->hashes[i];
+    }
+}
+
+void qoi_encode_task(void *arg, size_t index) {
+    Qoi_Encoder *job = arg;
+    Qoi_Chunk *chunk = &job->chunks[index];
+    size_t start = (size_t) index * job->rows_per_chunk * job->width;
+    size_t end = (size_t) MIN(job->count, (int) (index + 1) * job->rows_per_chunk) * job->width;
+    const uint32_t *px = (const uint32_t*) job->pixels;
+    const uint8_t *hashes = job->hashes;
+    uint32_t previous = start > 0 ? px[start - 1] : job->previous;
+
+    // an op takes at most 5 bytes
+    size_t capacity = 5 * (end - start);
+    if (chunk->bytes.capacity < capacity) {
+        chunk->bytes.items = realloc(chunk->bytes.items, capacity);
+        assert(chunk->bytes.items != NULL);
+        chunk->bytes.capacity = capacity;
+    }
+    uint8_t *out = chunk->bytes.items;
+    for (size_t i=start; i<end;) {
+        if (px[i] == previous) {
+            size_t run = qoi_run_length(&px[i], end - i, previous);
+            i += run;
+            for (; run > 0; run -= MIN(run, 62)) *out++ = QOI_OP_RUN | (MIN(run, 62) - 1);
+            continue;
+        }
+        uint32_t p = px[i];
+        uint8_t h = hashes[i];
+        if (chunk->index[h] == p) {
+            *out++ = QOI_OP_INDEX | h;
+        } else {
+            chunk->index[h] = p;
+            if ((p ^ previous) >> 24 == 0) {
+                int8_t dr = (p & 0xFF) - (previous & 0xFF);
+                int8_t dg = (p >> 8 & 0xFF) - (previous >> 8 & 0xFF);
+                int8_t db = (p >> 16 & 0xFF) - (previous >> 16 & 0xFF);
+                int8_t dr_dg = dr - dg, db_dg = db - dg;
+                if (-2 <= dr && dr <= 1 && -2 <= dg && dg <= 1 && -2 <= db && db <= 1) {
+                    *out++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+                } else if (-32 <= dg && dg <= 31 && -8 <= dr_dg && dr_dg <= 7 && -8 <= db_dg && db_dg <= 7) {
+                    *out++ = QOI_OP_LUMA | (dg + 32);
+                    *out++ = (dr_dg + 8) << 4 | (db_dg + 8);
+                } else {
+                    *out++ = QOI_OP_RGB;
+                    memcpy(out, &p, 3);
+                    out += 3;
+                }
+            } else {
+                *out++ = QOI_OP_RGBA;
+                memcpy(out, &p, 4);
+                out += 4;
+            }
+        }
+        previous = p;
+        i++;
+    }
+    chunk->bytes.count = out - chunk->bytes.items;
+}
+
+// the pushed pixels are RGBA, channels only tells readers whether the alpha channel matters
+void qoi_encoder_open(Qoi_Encoder *job, File_Writer *out, int width, int height, int channels) {
+    size_t threads = MAX(export_pool.thread_count, 1);
+    *job = (Qoi_Encoder) {
+        .out = out,
+        .width = width,
+        .height = height,
+        .previous = 0xFF000000,
+    };
+    job->rows_per_chunk = MAX(1, QOI_CHUNK_SIZE / width);
+    job->band_rows = job->rows_per_chunk * threads;
+    job->hashes = malloc((size_t) width * job->band_rows);
+    job->chunks = calloc(threads, sizeof(*job->chunks));
+    assert(job->hashes != NULL && job->chunks != NULL);
+
+    uint8_t header[14] = { 'q', 'o', 'i', 'f' };
+    put_u32_be(&header[4], width);
+    put_u32_be(&header[8], height);
+    header[12] = channels;
+    header[13] = 0; // sRGB with linear alpha
+    file_write(out, header, sizeof(header));
+}
+
+// the next count rows, at most band_rows
+void qoi_encoder_push(Qoi_Encoder *job, uint8_t *pixels, int count) {
+    assert(0 < count && count <= job->band_rows && job->y + count <= job->height);
+    job->pixels = pixels;
+    job->count = count;
+    job->chunk_count = (count + job->rows_per_chunk - 1) / job->rows_per_chunk;
+    pool_run(&export_pool, qoi_hash_task, job, job->chunk_count);
+    for (size_t k=0; k<job->chunk_count; k++) {
+        Qoi_Chunk *chunk = &job->chunks[k];
+        memcpy(chunk->index, job->index, sizeof(job->index));
+        for (int h=0; h<64; h++) {
+            if (chunk->seen >> h & 1) job->index[h] = chunk->last[h];
         }
+    }
+    pool_run(&export_pool, qoi_encode_task, job, job->chunk_count);
+    for (size_t k=0; k<job->chunk_count; k++) {
+        file_write(job->out, job->chunks[k].bytes.items, job->chunks[k].bytes.count);
+    }
+    memcpy(&job->previous, &pixels[((size_t) count * job->width - 1) * 4], 4);
+    job->y += count;
+}
+
+void qoi_encoder_close(Qoi_Encoder *job) {
+    assert(job->y == job->height);
+    static const uint8_t end[] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    file_write(job->out, end, sizeof(end));
+    for (size_t k=0; k<(size_t) job->band_rows / job->rows_per_chunk; k++) free(job->chunks[k].bytes.items);
+    free(job->chunks);
+    free(job->hashes);
+}
+
+typedef enum {
+    IMAGE_PNG,
+    IMAGE_BMP,
+    IMAGE_TGA,
+    IMAGE_JPG,
+    IMAGE_QOI,
+} Image_Format;
+
+// NOTE: export pushes the image in bands of band_rows rows to one of the encoders, so the
+// memory it needs besides the image grows with the rows in flight and not with the whole image.
+// The rows keep the channels of the image in RGB order, PNG and JPEG encode them as they are.
+typedef struct {
+    Image_Format format;
+    File_Writer out;
+    int width, height;
+    int channels;         // of the pushed rows
+    int stored_channels;  // of the pixels in the file
+    int band_rows;
+    Png_Encoder png;
+    Jpeg_Encoder *jpeg;
+    Qoi_Encoder qoi;
+    uint8_t *converted;   // a row for BMP and TGA, a band for QOI
+} Image_Writer;
+
+// returns false when the extension is not known or the file can not be created
+bool image_writer_open(Image_Writer *w, const char *path, const char *ext, int width, int height, int channels) {
+    *w = (Image_Writer) { .width = width, .height = height, .channels = channels, .stored_channels = channels, .band_rows = 1 };
+    if (strcmp(ext, ".png") == 0) {
+        w->format = IMAGE_PNG;
+    } else if (strcmp(ext, ".bmp") == 0) {
+        w->format = IMAGE_BMP;
+    } else if (strcmp(ext, ".tga") == 0) {
+        w->format = IMAGE_TGA;
+    } else if (strcmp(ext, ".jpg") == 0) {
+        w->format = IMAGE_JPG;
+    } else if (strcmp(ext, ".qoi") == 0) {
+        w->format = IMAGE_QOI;
     } else {
         printf("[ERROR] did not recognise file extension '%s', can't export image\n", ext);
+        return false;
+    }
+    if (!file_writer_open(&w->out, path)) {
+        file_writer_close(&w->out);
+        return false;
+    }
+    bool alpha = channels % 2 == 0;
+    switch (w->format) {
+        case IMAGE_PNG:
+            png_encoder_open(&w->png, &w->out, width, height, channels);
+            w->band_rows = w->png.band_rows;
+            break;
+        case IMAGE_BMP:
+            // BMP has no gray pixels
+            w->stored_channels = alpha ? 4 : 3;
+            bmp_write_header(&w->out, width, height, w->stored_channels);
+            w->converted = malloc((size_t) width * 4);
+            assert(w->converted != NULL);
+            break;
+        case IMAGE_TGA:
+            tga_write_header(&w->out, width, height, channels);
+            w->converted = malloc((size_t) width * 4);
+            assert(w->converted != NULL);
+            break;
+        case IMAGE_JPG:
+            w->jpeg = malloc(sizeof(*w->jpeg));
+            assert(w->jpeg != NULL);
+            jpeg_encoder_open(w->jpeg, &w->out, width, height, channels, jpeg_quality == 0 ? 50 : jpeg_quality, jpeg_subsampling);
+            w->band_rows = w->jpeg->band_rows;
+            break;
+        case IMAGE_QOI:
+            // the encoder works on RGBA pixels
+            w->stored_channels = alpha ? 4 : 3;
+            qoi_encoder_open(&w->qoi, &w->out, width, height, w->stored_channels);
+            w->band_rows = w->qoi.band_rows;
+            if (channels != 4) {
+                w->converted = malloc((size_t) width * w->band_rows * 4);
+                assert(w->converted != NULL);
+            }
+            break;
+    }
+    return true;
+}
+
+// the next count rows, at most band_rows
+void image_writer_push(Image_Writer *w, uint8_t *pixels, int count) {
+    switch (w->format) {
+        case IMAGE_PNG: png_encoder_push(&w->png, pixels, count); break;
+        case IMAGE_JPG: jpeg_encoder_push(w->jpeg, pixels, count); break;
+        case IMAGE_QOI:
+            if (w->converted != NULL) {
+                convert_pixels(w->converted, 4, pixels, w->channels, (size_t) w->width * count);
+                pixels = w->converted;
+            }
+            qoi_encoder_push(&w->qoi, pixels, count);
+            break;
+        case IMAGE_BMP:
+        case IMAGE_TGA:
+            // both store BGR(A)
+            for (int i=0; i<count; i++) {
+                int n = w->stored_channels;
+                convert_pixels(w->converted, n, &pixels[(size_t) i * w->width * w->channels], w->channels, w->width);
+                swap_red_blue(w->converted, w->width, n);
+                if (w->format == IMAGE_BMP) bmp_write_row(&w->out, w->converted, w->width, n);
+                else tga_write_row(&w->out, w->converted, w->width, n);
+            }
+            break;
+    }
+}
+
+// returns false when anything could not be written
+bool image_writer_close(Image_Writer *w) {
+    switch (w->format) {
+        case IMAGE_PNG: png_encoder_close(&w->png); break;
+        case IMAGE_JPG: jpeg_encoder_close(w->jpeg); break;
+        case IMAGE_QOI: qoi_encoder_close(&w->qoi); break;
+        case IMAGE_BMP:
+        case IMAGE_TGA: break;
+    }
+    free(w->jpeg);
+    free(w->converted);
+    return file_writer_close(&w->out);
+}
+
+// takes the pixels of ctx, ctx can only be reset afterwards
+Export_Job export_job(Draw_Context *ctx, const char *path) {
+    Export_Job result = {
+        .path = path,
+        .ext = get_file_ext(path),
+        .source = ctx->path,
+        .pixel_data = ctx->pixel_data,
+        .width = ctx->width,
+        .height = ctx->height,
+        .channels = ctx->channels,
+        .block_count = ctx->stack.cursor/2,
+    };
+    result.blocks = malloc(sizeof(*result.blocks) * MAX(result.block_count, 1));
+    assert(result.blocks != NULL);
+    for (size_t i=0; i<result.block_count; i++) result.blocks[i] = block_texels(ctx, i);
+    ctx->pixel_data = NULL;
+    return result;
+}
+
+// blend the blocks into the image and write it, frees the memory of the job
+// NOTE: runs on the thread of export_queue, so it may not touch global_arena or the window
+bool export(Export_Job *job) {
+    // a JPEG keeps everything outside of the blocks as it is when it is written as a JPEG again,
+    // unless it should be encoded with a different quality or subsampling
+    bool keep_encoding = jpeg_quality == 0 && jpeg_subsampling == SUBSAMPLING_AUTO;
+    if (strcmp(job->ext, ".jpg") == 0 && block_color.a == 255 && keep_encoding
+        && jpeg_redact(job->source, job->path, job->blocks, job->block_count, block_color)) {
+        stbi_image_free(job->pixel_data);
+        free(job->blocks);
+        printf("[INFO] wrote file '%s'\n", job->path);
+        return true;
+    }
+
+    Color block = native_color(block_color);
+    if (job->channels <= 2 && job->block_count > 0 && !(block.r == block.g && block.g == block.b)) {
+        // colored blocks on a gray image need the color channels
+        size_t count = layout_size(job->width, job->height);
+        uint8_t *wide = malloc(count * (job->channels + 2) + IMAGE_PADDING);
+        assert(wide != NULL);
+        convert_pixels(wide, job->channels + 2, job->pixel_data, job->channels, count);
+        stbi_image_free(job->pixel_data);
+        job->pixel_data = wide;
+        job->channels += 2;
+    }
+    Arena arena = {0};
+    Rectangle *rects = arena_alloc(&arena, sizeof(*rects) * MAX(job->block_count, 1));
+    for (size_t i=0; i<job->block_count; i++) {
+        Texel_Rectangle t = job->blocks[i];
+        rects[i] = (Rectangle) { .x = t.x0, .y = t.y0, .width = t.x1 - t.x0, .height = t.y1 - t.y0 };
+    }
+    Rectangle image = { .x = 0, .y = 0, .width = job->width, .height = job->height };
+    Coverage covered = coverage(rects, job->block_count, image, &arena);
+    for (size_t b=0; b<covered.count; b++) {
+        Coverage_Band *band = &covered.items[b];
+        for (int y=band->y0; y<band->y1; y++) {
+            for (size_t k=0; k<band->count; k++) {
+                for (int j=band->spans[k].x0; j<band->spans[k].x1;) {
+                    size_t n = pixel_run(j, band->spans[k].x1 - j);
+                    uint8_t *run = pixel_at(job->pixel_data, job->width, job->height, job->channels, j, y);
+                    if (block.a == 255) {
+                        if (job->channels == 4) fill_span(run, n, block);
+                        else fill_image_span(run, n, job->channels, block);
+                    } else if (job->channels != 4) {
+                        for (size_t l=0; l<n; l++) blend_image_color(run, l, job->channels, block);
+                    } else {
+                        // NOTE: the image may have transparent pixels, blend_span only handles opaque ones
+                        for (size_t l=0; l<n; l++) blend_color(run, l, block);
+                    }
+                    j += n;
+                }
+            }
+        }
+    }
+    arena_free(&arena);
+
+    bool ok = false;
+    const char *path = job->path;
+    Image_Writer writer;
+    if (image_writer_open(&writer, path, job->ext, job->width, job->height, job->channels)) {
+        // the encoders want RGB(A) or gray pixels row by row, other pixels are converted a band at a time
+        bool bgr = pixel_format == RGFW_formatBGRA8 && job->channels >= 3;
+        bool convert = pixel_layout != LAYOUT_LINEAR || bgr;
+        uint8_t *band = NULL;
+        if (convert) {
+            band = malloc((size_t) job->width * writer.band_rows * job->channels);
+            assert(band != NULL);
+        }
+        for (int y=0; y<job->height; y+=writer.band_rows) {
+            int count = MIN(writer.band_rows, job->height - y);
+            uint8_t *rows = &job->pixel_data[(size_t) y * job->width * job->channels];
+            if (convert) {
+                layout_to_linear(job->pixel_data, job->width, job->height, job->channels, y, count, band);
+                if (bgr) swap_red_blue(band, (size_t) job->width * count, job->channels);
+                rows = band;
+            }
+            image_writer_push(&writer, rows, count);
+        }
+        free(band);
+        ok = image_writer_close(&writer);
+    }
+    stbi_image_free(job->pixel_data);
+    free(job->blocks);
+
+    if (ok) {
+        printf("[INFO] wrote file '%s'\n", path);
+    } else {
+        printf("[ERROR] could not write file '%s'\n", path);
+    }
+    return ok;
+}
+
+void *export_worker(void *arg) {
+    Export_Queue *queue = arg;
+    pthread_mutex_lock(&queue->mutex);
+    for (;;) {
+        while (!queue->quit && queue->count == 0) pthread_cond_wait(&queue->changed, &queue->mutex);
+        if (queue->count == 0) break;
+        Export_Job job = queue->items[queue->first];
+        queue->first = (queue->first + 1) % EXPORT_QUEUE_CAPACITY;
+        queue->count--;
+        queue->busy = true;
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->mutex);
+
+        bool ok = export(&job);
+
+        pthread_mutex_lock(&queue->mutex);
+        queue->busy = false;
+        if (!ok) queue->failed++;
+        pthread_cond_broadcast(&queue->changed);
+        // the window title shows the progress
+        wake_event_loop();
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return NULL;
+}
+
+void export_queue_init(Export_Queue *queue) {
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    if (pthread_create(&queue->thread, NULL, export_worker, queue) != 0) {
+        printf("[ERROR] could not create export thread\n");
         exit(1);
     }
+}
+
+void export_queue_push(Export_Queue *queue, Export_Job job) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == EXPORT_QUEUE_CAPACITY) pthread_cond_wait(&queue->changed, &queue->mutex);
+    queue->items[(queue->first + queue->count) % EXPORT_QUEUE_CAPACITY] = job;
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->mutex);
+}
 
-    printf("[INFO] wrote file '%s'\n", path);
+// pending is the number of jobs that are not written yet
+void export_queue_status(Export_Queue *queue, size_t *pending, size_t *failed) {
+    pthread_mutex_lock(&queue->mutex);
+    *pending = queue->count + queue->busy;
+    *failed = queue->failed;
+    pthread_mutex_unlock(&queue->mutex);
 }
 
-void zoom(Draw_Context *ctx, float steps) {
+// writes all pushed jobs and stops the thread, returns the number of failed exports
+size_t export_queue_free(Export_Queue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->quit = true;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->mutex);
+    pthread_join(queue->thread, NULL);
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->changed);
+    return queue->failed;
+}
+
+void set_title(size_t pending, size_t failed) {
+    char title[64];
+    if (pending == 0 && failed == 0) {
+        snprintf(title, sizeof(title), "Bloc");
+    } else if (failed == 0) {
+        snprintf(title, sizeof(title), "Bloc - exporting %zu", pending);
+    } else {
+        snprintf(title, sizeof(title), "Bloc - exporting %zu, %zu failed", pending, failed);
+    }
+    RGFW_window_setName(win, title);
+}
+
+// scale the view by factor while the point under the mouse stays in place
+void zoom(Draw_Context *ctx, float factor) {
     Rectangle screen = window_rectangle();
     Vector2 mouse_screen = get_mouse_position();
     Vector2 mouse_normal = rectangle_transform(mouse_screen, rectangle_invert(screen));
 
-    float new_scale = ctx->scale * (1 + ZOOM_STEP*steps);
+    float new_scale = ctx->scale * factor;
     Vector2 new_center = {
         .x = ctx->center.x + screen.width  * (mouse_normal.x - 0.5f) * (1.0 / ctx->scale - 1.0 / new_scale),
         .y = ctx->center.y + screen.height * (mouse_normal.y - 0.5f) * (1.0 / ctx->scale - 1.0 / new_scale),
@@ -554,29 +4372,63 @@ void zoom(Draw_Context *ctx, float steps) {
     ctx->center = new_center;
 }
 
+// the best quality that can be drawn within the frame budget while the view changes
+Quality interactive_quality(double render_cost[QUALITY_COUNT]) {
+    Rectangle screen = window_rectangle();
+    double budget = frame_rate > 0 ? 1000.0 / frame_rate : FRAME_BUDGET;
+    double area = screen.width * screen.height;
+    if (render_cost[QUALITY_NEAREST] * area <= budget) return QUALITY_NEAREST;
+    // the fast quality samples about half as much, with enough headroom try the nearest neighbour again.
+    // Until a fast frame was measured its cost is estimated from the nearest neighbour.
+    double fast = render_cost[QUALITY_FAST] > 0 ? render_cost[QUALITY_FAST] : render_cost[QUALITY_NEAREST] / 2;
+    if (fast * area * 2 <= budget) return QUALITY_NEAREST;
+    return QUALITY_FAST;
+}
+
+bool view_input_pending(View_Input input) {
+    return input.zoom != 1 || input.pan_x != 0 || input.pan_y != 0;
+}
+
+// NOTE: zooms around the same point compose to a single zoom by the product of their factors,
+// so folding all of them into one around the current mouse position is exact
+void view_input_apply(Draw_Context *ctx, View_Input *input) {
+    if (input->pan_x != 0 || input->pan_y != 0) pan(ctx, input->pan_x, input->pan_y);
+    if (input->zoom != 1) zoom(ctx, input->zoom);
+    input->zoom = 1;
+    input->pan_x = 0;
+    input->pan_y = 0;
+}
+
 int main(int argc, const char **argv) {
     parse_commands(argc, argv);
 
+    pool_init(&pool, thread_count);
+    pool_init(&export_pool, export_thread_count);
+    export_queue_init(&export_queue);
+
     win = RGFW_createWindow("Bloc", 0, 0, 800, 600, RGFW_windowCenter);
 	RGFW_window_setExitKey(win, RGFW_escape);
 
-    {
-        RGFW_monitor mon = RGFW_window_getMonitor(win);
-        pixel_buffer = arena_alloc(&global_arena, sizeof(u8) * mon.mode.w * mon.mode.h * 4);
-        pixel_stride = mon.mode.w;
-        surface = RGFW_createSurface(pixel_buffer, mon.mode.w, mon.mode.h, RGFW_formatRGBA8);
-    }
+    pixel_format = native_surface_format(win);
+    framebuffer_fit(window_rectangle());
 
     size_t index = 0;
-    Draw_Context ctx = draw_context_new(input_paths.items[index]);
+    Draw_Context ctx = {0};
+    size_t load_failed = draw_context_load_next(&ctx, &input_paths, &index);
+    if (index == input_paths.count) exit(1);
     fit(&ctx);
 
     bool exit_window = false;
-    bool redraw = false;
+    Damage damage = { .full = true };
+    Frame_State shown = frame_state(&ctx);
+    double next_frame = 0; // earliest time in milliseconds the next frame may be drawn
+    View_Input input = { .zoom = 1 };
+    size_t title_pending = 0, title_failed = 0; // export status shown in the title
+    double last_view_change = 0;
+    double render_cost[QUALITY_COUNT] = {0}; // milliseconds per pixel of the last full repaint
     RGFW_event event;
     while (!exit_window) {
         while (RGFW_window_checkEvent(win, &event)) {
-            redraw = true;
             switch (event.type) {
                 case RGFW_quit:
                     exit_window = true;
@@ -589,58 +4441,117 @@ int main(int argc, const char **argv) {
                     } else if (event.key.value == RGFW_r) {
                         redo(&ctx);
                     } else if (event.key.value == RGFW_enter) {
+                        view_input_apply(&ctx, &input);
                         if (ctx.stack.cursor >= 2) {
-                            export(&ctx, output_paths.items[index]);
+                            export_queue_push(&export_queue, export_job(&ctx, output_paths.items[index]));
                         }
                         draw_context_reset(&ctx);
                         index++;
-                        if (index < input_paths.count) {
-                            draw_context_load(&ctx, input_paths.items[index]);
-                        } else {
-                            exit_window = true;
-                        }
+                        damage.full = true;
+                        load_failed += draw_context_load_next(&ctx, &input_paths, &index);
+                        if (index == input_paths.count) exit_window = true;
                     } else if (event.key.value == RGFW_j) {
-                        pan_down(&ctx);
+                        input.pan_y++;
                     } else if (event.key.value == RGFW_k) {
-                        pan_up(&ctx);
+                        input.pan_y--;
                     } else if (event.key.value == RGFW_h) {
-                        pan_left(&ctx);
+                        input.pan_x--;
                     } else if (event.key.value == RGFW_l) {
-                        pan_right(&ctx);
+                        input.pan_x++;
                     } else if (event.key.value == RGFW_space) {
+                        view_input_apply(&ctx, &input);
                         fit(&ctx);
                     }
                     break;
                 case RGFW_mouseButtonPressed:
                     if (event.button.value == RGFW_mouseLeft) {
+                        view_input_apply(&ctx, &input);
                         click(&ctx);
                     }
                     break;
                 case RGFW_mouseScroll:
                     // TODO: make it possible to zoom by keyboard presses (+/-)
-                    zoom(&ctx, get_mouse_wheel_move());
+                    input.zoom *= 1 + ZOOM_STEP*event.scroll.y;
+                    break;
+                case RGFW_windowRefresh:
+                case RGFW_windowResized:
+                case RGFW_windowMaximized:
+                case RGFW_windowRestored:
+                    damage.full = true;
                     break;
             }
         }
 
+        size_t pending, failed;
+        export_queue_status(&export_queue, &pending, &failed);
+        if (pending != title_pending || failed != title_failed) {
+            set_title(pending, failed);
+            title_pending = pending;
+            title_failed = failed;
+        }
+
         // drawing
-        if (!exit_window && redraw) { // memory may be invalidated when exit_window is true
-            clear(BACKGROUND_COLOR);
-            draw(&ctx);
-            RGFW_window_blitSurface(win, surface);
-            redraw = false;
+        if (!exit_window) { // memory may be invalidated when exit_window is true
+            // NOTE: what is shown only changes through events and the refinement of the quality,
+            // so when it is up to date we sleep until the next one of them
+            double now = time_ms();
+            if (quality != QUALITY_FILTERED && now - last_view_change >= REFINE_DELAY) {
+                quality = QUALITY_FILTERED;
+            }
+            i32 wait = RGFW_eventWaitNext;
+            if (damage.full || view_input_pending(input) || !frame_state_equal(shown, frame_state(&ctx))) {
+                if (now >= next_frame) {
+                    if (view_input_pending(input)) {
+                        quality = interactive_quality(render_cost);
+                        last_view_change = now;
+                    }
+                    view_input_apply(&ctx, &input);
+                    if (framebuffer_fit(window_rectangle())) damage.full = true;
+                    double render_start = time_ms(); // resizing the framebuffer is not part of the cost
+                    Frame_State current = frame_state(&ctx);
+                    damage_frame(&damage, &ctx, shown, current);
+                    if (damage.full) {
+                        render(&ctx, &damage);
+                        Rectangle screen = window_rectangle();
+                        render_cost[current.quality] = (time_ms() - render_start) / (screen.width * screen.height);
+                    } else if (damage.count > 0) {
+                        render(&ctx, &damage);
+                    }
+                    shown = current;
+                    next_frame = now + (frame_rate > 0 ? 1000.0 / frame_rate : 0);
+                } else {
+                    wait = ceil(next_frame - now);
+                }
+            }
+            if (quality != QUALITY_FILTERED) {
+                i32 refine = MAX(1, ceil(last_view_change + REFINE_DELAY - now));
+                if (wait < 0 || refine < wait) wait = refine;
+            }
+            wait_for_event(wait);
         }
     }
 
     if (index < input_paths.count) {
         // if we did not edit all given images export the current one anyways
         if (ctx.stack.cursor >= 2) {
-            export(&ctx, output_paths.items[index]);
+            export_queue_push(&export_queue, export_job(&ctx, output_paths.items[index]));
         }
         draw_context_reset(&ctx);
     }
+    size_t pending, failed;
+    export_queue_status(&export_queue, &pending, &failed);
+    if (pending > 0) printf("[INFO] waiting for %zu export(s) to finish\n", pending);
+    failed = export_queue_free(&export_queue);
+    if (failed > 0) printf("[ERROR] %zu export(s) failed\n", failed);
+    if (load_failed > 0) printf("[ERROR] %zu image(s) could not be loaded\n", load_failed);
 
+    blit_surface_free();
+    framebuffer_free();
     RGFW_window_close(win);
 
+    pool_free(&pool);
+    pool_free(&export_pool);
+    arena_free(&frame_arena);
     arena_free(&global_arena);
+    return failed > 0 || load_failed > 0 ? 1 : 0;
 }
@@ -1,3 +1,225 @@
 #define RGFW_IMPLEMENTATION
 #define RGFW_EXPORT
 #include "RGFW.h"
+
+#include <pthread.h>
+
+#if defined(RGFW_X11) && !defined(RGFW_WAYLAND)
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+// NOTE: with the MIT-SHM extension the converted pixels are handed to the X server through a
+// shared memory segment instead of being pushed through the socket. It is set up on the first
+// blit and silently replaced by XPutImage when the server can not attach the segment
+// (e.g. when the display is remote).
+static struct {
+    RGFW_bool tried;
+    RGFW_bool failed;  // set by the error handler while attaching
+    RGFW_bool pending; // the server might still be reading from the segment
+    XShmSegmentInfo info;
+    XImage *image;     // NULL when shared memory is not available
+} shm = {0};
+
+static int shm_error_handler(Display *display, XErrorEvent *event) {
+    RGFW_UNUSED(display); RGFW_UNUSED(event);
+    shm.failed = RGFW_TRUE;
+    return 0;
+}
+
+static void shm_release(void) {
+    if (shm.image == NULL) return;
+    XShmDetach(_RGFW->display, &shm.info);
+    XSync(_RGFW->display, False);
+    shmdt(shm.info.shmaddr);
+    shm.image->data = NULL;
+    XDestroyImage(shm.image);
+    shm.image = NULL;
+    shm.pending = RGFW_FALSE;
+}
+
+static XImage *shm_image(RGFW_window *win, RGFW_surface *surface) {
+    if (shm.image != NULL && (shm.image->width != surface->w || shm.image->height != surface->h)) {
+        shm_release();
+        shm.tried = RGFW_FALSE;
+    }
+    if (shm.tried) return shm.image;
+    shm.tried = RGFW_TRUE;
+
+    Display *display = _RGFW->display;
+    if (!XShmQueryExtension(display)) return NULL;
+    XWindowAttributes attrs;
+    if (XGetWindowAttributes(display, win->src.window, &attrs) == 0) return NULL;
+    XImage *image = XShmCreateImage(display, attrs.visual, (u32)attrs.depth, ZPixmap, NULL, &shm.info, (u32)surface->w, (u32)surface->h);
+    if (image == NULL) return NULL;
+    if (image->bits_per_pixel != 32) {
+        XDestroyImage(image);
+        return NULL;
+    }
+
+    shm.info.shmid = shmget(IPC_PRIVATE, (size_t)image->bytes_per_line * image->height, IPC_CREAT | 0600);
+    if (shm.info.shmid < 0) {
+        XDestroyImage(image);
+        return NULL;
+    }
+    shm.info.shmaddr = image->data = shmat(shm.info.shmid, NULL, 0);
+    shm.info.readOnly = False;
+    if (shm.info.shmaddr == (char*) -1) {
+        shmctl(shm.info.shmid, IPC_RMID, NULL);
+        image->data = NULL;
+        XDestroyImage(image);
+        return NULL;
+    }
+
+    shm.failed = RGFW_FALSE;
+    XErrorHandler old_handler = XSetErrorHandler(shm_error_handler);
+    Status attached = XShmAttach(display, &shm.info);
+    XSync(display, False);
+    XSetErrorHandler(old_handler);
+    // the segment is destroyed as soon as both sides detached from it
+    shmctl(shm.info.shmid, IPC_RMID, NULL);
+    if (!attached || shm.failed) {
+        shmdt(shm.info.shmaddr);
+        image->data = NULL;
+        XDestroyImage(image);
+        return NULL;
+    }
+
+    shm.image = image;
+    return shm.image;
+}
+#endif
+
+// NOTE: RGFW_window_blitSurface converts and sends the whole surface every time,
+// on X11 it even converts the surface data in place.
+// This only converts and sends the given rectangle and leaves the surface data untouched.
+void blit_surface_rectangle(RGFW_window *win, RGFW_surface *surface, int x, int y, int width, int height) {
+#if defined(RGFW_X11) && !defined(RGFW_WAYLAND)
+    static u8 *native_data = NULL;
+    static size_t native_size = 0;
+
+    width  = RGFW_MIN(x + width,  RGFW_MIN(win->w, surface->w)) - x;
+    height = RGFW_MIN(y + height, RGFW_MIN(win->h, surface->h)) - y;
+    if (x < 0 || y < 0 || width <= 0 || height <= 0) return;
+
+    // NOTE: when the surface already has the format of the window its rows are sent as they are
+    RGFW_bool native = surface->format == surface->native.format;
+    XImage *image = shm_image(win, surface);
+    if (image != NULL) {
+        // wait until the server is done with the previous frame before overwriting it
+        if (shm.pending) XSync(_RGFW->display, False);
+        for (int i=y; i<y+height; i++) {
+            u8 *dst = (u8*) image->data + (size_t)i * image->bytes_per_line + (size_t)x * 4;
+            u8 *src = surface->data + ((size_t)i * surface->w + x) * 4;
+            if (native) {
+                RGFW_MEMCPY(dst, src, (size_t)width * 4);
+            } else {
+                RGFW_copyImageData(dst, width, 1, surface->native.format, src, surface->format);
+            }
+        }
+        XShmPutImage(_RGFW->display, win->src.window, win->src.gc, image, x, y, x, y, (u32)width, (u32)height, False);
+        XFlush(_RGFW->display);
+        shm.pending = RGFW_TRUE;
+        return;
+    }
+
+    image = surface->native.bitmap;
+    if (native) {
+        image->data = (char*) surface->data;
+        XPutImage(_RGFW->display, win->src.window, win->src.gc, image, x, y, x, y, (u32)width, (u32)height);
+        image->data = NULL;
+        return;
+    }
+
+    size_t size = (size_t)surface->w * surface->h * 4;
+    if (native_size < size) {
+        RGFW_FREE(native_data);
+        native_data = (u8*) RGFW_ALLOC(size);
+        RGFW_ASSERT(native_data != NULL);
+        native_size = size;
+    }
+    for (int i=y; i<y+height; i++) {
+        size_t offset = ((size_t)i * surface->w + x) * 4;
+        RGFW_copyImageData(native_data + offset, width, 1, surface->native.format, surface->data + offset, surface->format);
+    }
+
+    image->data = (char*) native_data;
+    XPutImage(_RGFW->display, win->src.window, win->src.gc, image, x, y, x, y, (u32)width, (u32)height);
+    image->data = NULL;
+#else
+    RGFW_UNUSED(x); RGFW_UNUSED(y); RGFW_UNUSED(width); RGFW_UNUSED(height);
+    RGFW_window_blitSurface(win, surface);
+#endif
+}
+
+// the format of the pixels the window expects, so that the surface can be drawn in it directly
+RGFW_format native_surface_format(RGFW_window *win) {
+#if defined(RGFW_X11) && !defined(RGFW_WAYLAND)
+    XWindowAttributes attrs;
+    if (XGetWindowAttributes(_RGFW->display, win->src.window, &attrs) != 0 && attrs.depth >= 24) {
+        Visual *visual = attrs.visual;
+        // RGFW always presents 32 bit BGRA on X11, which matches the common little endian visual
+        if (ImageByteOrder(_RGFW->display) == LSBFirst && visual->red_mask == 0xFF0000 && visual->green_mask == 0xFF00 && visual->blue_mask == 0xFF) {
+            return RGFW_formatBGRA8;
+        }
+    }
+#else
+    RGFW_UNUSED(win);
+#endif
+    return RGFW_formatRGBA8;
+}
+
+// release what blit_surface_rectangle keeps around, has to be called before the window is closed
+void blit_surface_free(void) {
+#if defined(RGFW_X11) && !defined(RGFW_WAYLAND)
+    shm_release();
+    shm.tried = RGFW_FALSE;
+#endif
+}
+
+// NOTE: on X11 RGFW_waitForEvent only polls the connection to the display, so RGFW_stopCheckEvents
+// can not wake it up from another thread. This waits on the connection and on a pipe that
+// wake_event_loop writes to, waitMS < 0 waits until one of them is ready.
+#if defined(RGFW_X11) && !defined(RGFW_WAYLAND)
+static pthread_once_t wake_once = PTHREAD_ONCE_INIT;
+static int wake_pipe[2] = {-1, -1};
+
+static void wake_pipe_init(void) {
+    if (pipe(wake_pipe) == -1) {
+        wake_pipe[0] = wake_pipe[1] = -1;
+        return;
+    }
+    fcntl(wake_pipe[0], F_SETFL, fcntl(wake_pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, fcntl(wake_pipe[1], F_GETFL) | O_NONBLOCK);
+}
+#endif
+
+void wait_for_event(i32 waitMS) {
+#if defined(RGFW_X11) && !defined(RGFW_WAYLAND)
+    pthread_once(&wake_once, wake_pipe_init);
+    // XPending flushes the outgoing requests and catches events that were already read
+    if (XPending(_RGFW->display) > 0) return;
+    struct pollfd fds[] = {
+        { ConnectionNumber(_RGFW->display), POLLIN, 0 },
+        { wake_pipe[0], POLLIN, 0 },
+    };
+    if (poll(fds, wake_pipe[0] < 0 ? 1 : 2, waitMS) > 0 && (fds[1].revents & POLLIN)) {
+        char data[64];
+        while (read(wake_pipe[0], data, sizeof(data)) > 0) {}
+    }
+#else
+    RGFW_waitForEvent(waitMS);
+#endif
+}
+
+// make wait_for_event return, can be called from any thread
+void wake_event_loop(void) {
+#if defined(RGFW_X11) && !defined(RGFW_WAYLAND)
+    pthread_once(&wake_once, wake_pipe_init);
+    if (wake_pipe[1] < 0) return;
+    const char byte = 0;
+    (void)!write(wake_pipe[1], &byte, 1);
+#else
+    RGFW_stopCheckEvents();
+#endif
+}